@@ -30,17 +30,52 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE /* The library is compiled as C99: enable POSIX APIs. */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define SDS_HAVE_MMAP
+#define SDS_HAVE_FDIO
+#endif
 #include "sds.h"
 #include "sdsalloc.h"
 
 const char *SDS_NOINIT = "SDS_NOINIT";
 
+#define UNUSED(x) (void)(x)
+
+/* The growth policy used by sdsMakeRoomFor(). The default one doubles the
+ * required length, but preallocates at most SDS_MAX_PREALLOC bytes. */
+static const sdsGrowthPolicy sdsDefaultGrowth = {
+    SDS_GROWTH_RATIO, 100, SDS_MAX_PREALLOC, NULL, NULL
+};
+static const sdsGrowthPolicy sdsExactGrowth = {
+    SDS_GROWTH_EXACT, 0, 0, NULL, NULL
+};
+static sdsGrowthPolicy sdsGrowth = {
+    SDS_GROWTH_RATIO, 100, SDS_MAX_PREALLOC, NULL, NULL
+};
+
+/* Strings with a capacity of at least sdsMmapThreshold bytes are stored
+ * in anonymous memory mappings, using the allocator context defined in the
+ * mmap storage section below. Zero disables the feature. */
+static size_t sdsMmapThreshold = 0;
+static sdsAllocator sdsMmapCtx;
+
 static inline int sdsHdrSize(char type) {
     switch(type&SDS_TYPE_MASK) {
         case SDS_TYPE_5:
@@ -73,36 +108,218 @@ static inline char sdsReqType(size_t string_size) {
 #endif
 }
 
-/* Create a new sds string with the content specified by the 'init' pointer
- * and 'initlen'.
- * If NULL is used for 'init' the string is initialized with zero bytes.
- * If SDS_NOINIT is used, the buffer is left uninitialized;
- *
- * The string is always null-terminated (all the sds strings are, always) so
- * even if you create an sds string with:
- *
- * mystring = sdsnewlen("abc",3);
+/* Return the max length that can be stored by the specified header type,
+ * used in order to clamp the usable size reported by the allocator. */
+static inline size_t sdsTypeMaxSize(char type) {
+    if (type == SDS_TYPE_5)
+        return (1<<5) - 1;
+    if (type == SDS_TYPE_8)
+        return (1<<8) - 1;
+    if (type == SDS_TYPE_16)
+        return (1<<16) - 1;
+#if (LONG_MAX == LLONG_MAX)
+    if (type == SDS_TYPE_32)
+        return (1ll<<32) - 1;
+#endif
+    return -1; /* this is equivalent to the max SDS_TYPE_64 or SDS_TYPE_32 */
+}
+
+/* Return the SDS_FLAG_* flags of the string 's'. Type 5 strings use the
+ * whole flags byte to store the length, so they never have flags. */
+static inline unsigned char sdsFlags(const sds s) {
+    unsigned char flags = s[-1];
+    if ((flags&SDS_TYPE_MASK) == SDS_TYPE_5) return 0;
+    return flags & ~SDS_TYPE_MASK;
+}
+
+/* Return the size of the prefix stored at the start of the allocation,
+ * before the SDS header, for a string with the specified flags byte. */
+static inline size_t sdsPrefixSize(unsigned char flags) {
+    size_t size = 0;
+
+    if ((flags&SDS_TYPE_MASK) == SDS_TYPE_5) return 0;
+    if (flags & SDS_FLAG_CTX) size += sizeof(sdsAllocator*);
+    if (flags & SDS_FLAG_SHARED) size += sizeof(size_t);
+    return size;
+}
+
+/* Return the number of bytes consumed from the head of a SDS_FLAG_OFFSET
+ * string (see sdsconsume()), stored just before the header. */
+static inline size_t sdsOffset(const sds s) {
+    size_t offset;
+
+    /* Not aligned: the header moves forward byte by byte. */
+    memcpy(&offset,s-sdsHdrSize(s[-1])-sizeof(size_t),sizeof(offset));
+    return offset;
+}
+
+/* Return the number of bytes between the start of the allocation and the
+ * header of 's': the prefix, plus the consumed bytes and their count for
+ * SDS_FLAG_OFFSET strings. */
+static inline size_t sdsPrefixLen(const sds s) {
+    size_t len = sdsPrefixSize(s[-1]);
+
+    if (sdsFlags(s) & SDS_FLAG_OFFSET) len += sizeof(size_t)+sdsOffset(s);
+    return len;
+}
+
+/* Return the pointer to the reference count of a SDS_FLAG_SHARED string,
+ * stored in the prefix after the allocator context, if any. */
+static inline size_t *sdsRefCountPtr(const sds s) {
+    char *p = sdsAllocPtr(s);
+
+    if (s[-1] & SDS_FLAG_CTX) p += sizeof(sdsAllocator*);
+    return (size_t*)p;
+}
+
+/* Return non zero if 's' is a shared string also referenced by others, so
+ * it is immutable and must be copied before any modification. */
+static inline int sdsIsShared(const sds s) {
+    return (sdsFlags(s) & SDS_FLAG_SHARED) &&
+           __atomic_load_n(sdsRefCountPtr(s),__ATOMIC_ACQUIRE) > 1;
+}
+
+/* Low level allocation functions for the string memory: when 'a' is NULL
+ * the default allocator defined in sdsalloc.h is used, otherwise the
+ * allocator context is called. */
+static void *sdsRawAlloc(sdsAllocator *a, size_t size) {
+    return a ? a->alloc(a,size) : s_malloc(size);
+}
+
+static void *sdsRawRealloc(sdsAllocator *a, void *ptr, size_t oldsize, size_t size) {
+    void *newptr;
+
+    if (a == NULL) return s_realloc(ptr,size);
+    if (a->resize) return a->resize(a,ptr,oldsize,size);
+    newptr = a->alloc(a,size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+    a->release(a,ptr,oldsize);
+    return newptr;
+}
+
+static void sdsRawFree(sdsAllocator *a, void *ptr, size_t size) {
+    if (a)
+        a->release(a,ptr,size);
+    else
+        s_free(ptr);
+}
+
+/* Return the usable size of the block 'ptr' of 'size' bytes, as reported
+ * by the allocator, or just 'size' if the allocator can't tell. */
+static size_t sdsRawUsable(sdsAllocator *a, void *ptr, size_t size) {
+    if (a) return a->usable ? a->usable(a,ptr) : size;
+#ifdef s_malloc_usable
+    return s_malloc_usable(ptr);
+#else
+    return size;
+#endif
+}
+
+/* Return the size of the allocation of 's' as known by SDS, that is the
+ * size requested to the allocator, possibly enlarged to the usable size
+ * it reported. */
+static inline size_t sdsRawSize(const sds s) {
+    return sdsPrefixLen(s)+sdsHdrSize(s[-1])+sdsalloc(s)+1;
+}
+
+/* Memory statistics. When SDS is compiled with SDS_STATS defined, every
+ * string is accounted when created, and unaccounted when freed. Every time
+ * a string is reallocated it is unaccounted before the reallocation, and
+ * accounted again after it. All the counters are updated atomically. */
+#ifdef SDS_STATS
+static sdsStats sdsStatsData;
+
+#define sdsStatsIncr(field,n) \
+    __atomic_add_fetch(&sdsStatsData.field,(n),__ATOMIC_RELAXED)
+#define sdsStatsDecr(field,n) \
+    __atomic_sub_fetch(&sdsStatsData.field,(n),__ATOMIC_RELAXED)
+
+static void sdsStatsTrack(const sds s, int incr) {
+    size_t bytes = sdsAllocSize(s);
+    size_t hdr = sdsPrefixSize(s[-1])+sdsHdrSize(s[-1]);
+    int type = s[-1]&SDS_TYPE_MASK;
+
+    if (incr > 0) {
+        sdsStatsIncr(strings[type],1);
+        sdsStatsIncr(alloc_bytes,bytes);
+        sdsStatsIncr(header_bytes,hdr);
+    } else {
+        sdsStatsDecr(strings[type],1);
+        sdsStatsDecr(alloc_bytes,bytes);
+        sdsStatsDecr(header_bytes,hdr);
+    }
+}
+#define sdsStatsAdd(s) sdsStatsTrack(s,1)
+#define sdsStatsDel(s) sdsStatsTrack(s,-1)
+#else
+/* Expand to a statement even when disabled, so that call sites like
+ * "if (...) sdsStatsIncr(...);" remain well formed. */
+#define sdsStatsIncr(field,n) ((void)0)
+#define sdsStatsAdd(s) ((void)0)
+#define sdsStatsDel(s) ((void)0)
+#endif
+
+/* Fill 'stats' with a snapshot of the SDS memory statistics. Returns 1 if
+ * SDS was compiled with SDS_STATS defined, otherwise 0 is returned and all
+ * the counters are set to zero.
  *
- * You can print the string with printf() as there is an implicit \0 at the
- * end of the string. However the string is binary safe and can contain
- * \0 characters in the middle, as the length is stored in the sds header. */
-sds sdsnewlen(const void *init, size_t initlen) {
+ * Note that for SDS_TYPE_5 strings, that don't store their allocation
+ * size, the memory is only exact if the allocator is able to report the
+ * usable size of its blocks (see sdsalloc.h). */
+int sdsGetStats(sdsStats *stats) {
+#ifdef SDS_STATS
+    size_t *src = (size_t*)&sdsStatsData, *dst = (size_t*)stats;
+    size_t j;
+
+    for (j = 0; j < sizeof(*stats)/sizeof(size_t); j++)
+        dst[j] = __atomic_load_n(src+j,__ATOMIC_RELAXED);
+    return 1;
+#else
+    memset(stats,0,sizeof(*stats));
+    return 0;
+#endif
+}
+
+/* Set the alloc field of 's', that uses the block 'sh' of 'size' bytes, to
+ * the usable size of the block, clamped to the max of the header type. */
+static void sdsSetUsableAlloc(sds s, sdsAllocator *a, void *sh, size_t size) {
+    size_t overhead = sdsPrefixSize(s[-1])+sdsHdrSize(s[-1])+1;
+    size_t usable = sdsRawUsable(a,sh,size)-overhead;
+    size_t maxsize = sdsTypeMaxSize(s[-1]&SDS_TYPE_MASK);
+
+    sdssetalloc(s, usable > maxsize ? maxsize : usable);
+}
+
+/* Create a new string of 'initlen' bytes copied from 'init' (see
+ * sdsnewlen() for the special values of 'init'), with room for 'cap' bytes
+ * in total, using the allocator context 'a', or the default one if NULL.
+ * 'sflags' are additional SDS_FLAG_* flags requiring a prefix. */
+static sds sdsCreate(const void *init, size_t initlen, size_t cap, sdsAllocator *a, unsigned char sflags) {
     void *sh;
     sds s;
-    char type = sdsReqType(initlen);
+    char type = sdsReqType(cap);
+    if (a == NULL && sdsMmapThreshold && cap >= sdsMmapThreshold)
+        a = &sdsMmapCtx;
+    if (a) sflags |= SDS_FLAG_CTX;
     /* Empty strings are usually created in order to append. Use type 8
-     * since type 5 is not good at this. */
-    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
+     * since type 5 is not good at this. Type 5 is also not able to
+     * store any flag or free space. */
+    if (type == SDS_TYPE_5 && (initlen == 0 || initlen != cap || sflags))
+        type = SDS_TYPE_8;
     int hdrlen = sdsHdrSize(type);
+    size_t prefixlen = sdsPrefixSize(type|sflags);
     unsigned char *fp; /* flags pointer. */
 
-    sh = s_malloc(hdrlen+initlen+1);
+    assert(initlen <= cap && prefixlen+hdrlen+cap+1 > cap);
+    sh = sdsRawAlloc(a, prefixlen+hdrlen+cap+1);
     if (sh == NULL) return NULL;
     if (init==SDS_NOINIT)
         init = NULL;
     else if (!init)
-        memset(sh, 0, hdrlen+initlen+1);
-    s = (char*)sh+hdrlen;
+        memset(sh, 0, prefixlen+hdrlen+initlen+1);
+    if (a) *(sdsAllocator**)sh = a;
+    s = (char*)sh+prefixlen+hdrlen;
     fp = ((unsigned char*)s)-1;
     switch(type) {
         case SDS_TYPE_5: {
@@ -112,59 +329,203 @@ sds sdsnewlen(const void *init, size_t initlen) {
         case SDS_TYPE_8: {
             SDS_HDR_VAR(8,s);
             sh->len = initlen;
-            sh->alloc = initlen;
-            *fp = type;
+            sh->alloc = cap;
+            *fp = type | sflags;
             break;
         }
         case SDS_TYPE_16: {
             SDS_HDR_VAR(16,s);
             sh->len = initlen;
-            sh->alloc = initlen;
-            *fp = type;
+            sh->alloc = cap;
+            *fp = type | sflags;
             break;
         }
         case SDS_TYPE_32: {
             SDS_HDR_VAR(32,s);
             sh->len = initlen;
-            sh->alloc = initlen;
-            *fp = type;
+            sh->alloc = cap;
+            *fp = type | sflags;
             break;
         }
         case SDS_TYPE_64: {
             SDS_HDR_VAR(64,s);
             sh->len = initlen;
-            sh->alloc = initlen;
-            *fp = type;
+            sh->alloc = cap;
+            *fp = type | sflags;
             break;
         }
     }
+    if (sflags & SDS_FLAG_SHARED) *sdsRefCountPtr(s) = 1;
+    if (type != SDS_TYPE_5)
+        sdsSetUsableAlloc(s, a, sh, prefixlen+hdrlen+cap+1);
     if (initlen && init)
         memcpy(s, init, initlen);
     s[initlen] = '\0';
+    sdsStatsAdd(s);
+    return s;
+}
+
+/* Create a new sds string with the content specified by the 'init' pointer
+ * and 'initlen'.
+ * If NULL is used for 'init' the string is initialized with zero bytes.
+ * If SDS_NOINIT is used, the buffer is left uninitialized;
+ *
+ * The string is always null-terminated (all the sds strings are, always) so
+ * even if you create an sds string with:
+ *
+ * mystring = sdsnewlen("abc",3);
+ *
+ * You can print the string with printf() as there is an implicit \0 at the
+ * end of the string. However the string is binary safe and can contain
+ * \0 characters in the middle, as the length is stored in the sds header. */
+sds sdsnewlen(const void *init, size_t initlen) {
+    return sdsCreate(init, initlen, initlen, NULL, 0);
+}
+
+/* Like sdsnewlen() but the string memory is obtained from the allocator
+ * context 'a'. The context is stored inside the string, so all the other
+ * SDS functions will use it when the string is resized or freed.
+ * If 'a' is NULL this is exactly like sdsnewlen(). */
+sds sdsnewlenctx(const void *init, size_t initlen, sdsAllocator *a) {
+    return sdsCreate(init, initlen, initlen, a, 0);
+}
+
+/* Create an empty string with room for at least 'cap' bytes, so that
+ * appending up to 'cap' bytes will not require any reallocation. */
+sds sdsnewcap(size_t cap) {
+    return sdsCreate("", 0, cap, NULL, 0);
+}
+
+/* Initialize an empty SDS_FLAG_STATIC string at 'buf', using the header
+ * 'type' (not SDS_TYPE_5) and having room for 'alloc' bytes. */
+static sds sdsStaticInit(void *buf, char type, size_t alloc) {
+    sds s = (char*)buf+sdsHdrSize(type);
+
+    s[-1] = type | SDS_FLAG_STATIC;
+    sdssetlen(s,0);
+    sdssetalloc(s,alloc);
+    s[0] = '\0';
     return s;
 }
 
+/* Create an empty string inside the 'cap' bytes of caller provided storage
+ * 'buf', usually a buffer on the stack, so that short lived strings do not
+ * need to hit the allocator at all:
+ *
+ * char buf[128];
+ * sds s = sdsStackInit(buf,sizeof(buf));
+ * s = sdscatfmt(s,"%s:%i",prefix,id);
+ * ...
+ * sdsfree(s);
+ *
+ * The string can be used with all the SDS functions. Once its content no
+ * longer fits into 'buf', sdsMakeRoomFor() transparently moves it to a
+ * new heap allocation (so, as usual, the returned pointer must always be
+ * used). sdsfree() does nothing if the string is still inside 'buf', so
+ * it is always safe to call it, but 'buf' must remain valid for all the
+ * time the string is in use.
+ *
+ * 'cap' must be large enough to hold the header and the null term: with
+ * less than 256 bytes the overhead is 3 bytes. */
+sds sdsStackInit(void *buf, size_t cap) {
+    char type = sdsReqType(cap);
+    int hdrlen;
+
+    if (type == SDS_TYPE_5) type = SDS_TYPE_8;
+    hdrlen = sdsHdrSize(type);
+    assert(cap > (size_t)hdrlen);
+    return sdsStaticInit(buf,type,cap-hdrlen-1);
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
     return sdsnewlen("",0);
 }
 
+/* Create an empty sds string using the allocator context 'a'. */
+sds sdsemptyctx(sdsAllocator *a) {
+    return sdsnewlenctx("",0,a);
+}
+
 /* Create a new sds string starting from a null terminated C string. */
 sds sdsnew(const char *init) {
     size_t initlen = (init == NULL) ? 0 : strlen(init);
     return sdsnewlen(init, initlen);
 }
 
-/* Duplicate an sds string. */
+/* Create a new sds string starting from a null terminated C string, using
+ * the allocator context 'a'. */
+sds sdsnewctx(const char *init, sdsAllocator *a) {
+    size_t initlen = (init == NULL) ? 0 : strlen(init);
+    return sdsnewlenctx(init, initlen, a);
+}
+
+/* Duplicate an sds string. The new string uses the same allocator
+ * context of 's'. If 's' is a shared string (see sdsshare()) no copy is
+ * performed: the reference count is incremented and 's' is returned. */
 sds sdsdup(const sds s) {
-    return sdsnewlen(s, sdslen(s));
+    if (sdsFlags(s) & SDS_FLAG_SHARED) {
+        __atomic_add_fetch(sdsRefCountPtr(s),1,__ATOMIC_RELAXED);
+        return s;
+    }
+    return sdsnewlenctx(s, sdslen(s), sdsGetAllocator(s));
 }
 
-/* Free an sds string. No operation is performed if 's' is NULL. */
+/* Free an sds string. No operation is performed if 's' is NULL. Shared
+ * strings are only released when the last reference is freed. */
 void sdsfree(sds s) {
-    if (s == NULL) return;
-    s_free((char*)s-sdsHdrSize(s[-1]));
+    if (s == NULL || sdsFlags(s) & SDS_FLAG_STATIC) return;
+    if (sdsFlags(s) & SDS_FLAG_SHARED &&
+        __atomic_sub_fetch(sdsRefCountPtr(s),1,__ATOMIC_ACQ_REL) != 0) return;
+    sdsStatsDel(s);
+    sdsRawFree(sdsGetAllocator(s), sdsAllocPtr(s), sdsRawSize(s));
+}
+
+/* Replace 's' with a new private string holding the 'len' bytes at 'p',
+ * with room for 'cap' bytes, dropping the reference to 's'. This is used
+ * to modify strings that are shared, or not owned by SDS. Returns NULL on
+ * out of memory, in which case 's' is left untouched. */
+static sds sdsCopyOnWrite(sds s, const char *p, size_t len, size_t cap) {
+    sds copy = sdsCreate(p, len, cap, sdsGetAllocator(s), 0);
+
+    if (copy == NULL) return NULL;
+    sdsfree(s);
+    return copy;
+}
+
+/* Turn 's' into a shared string: further calls to sdsdup() just increment
+ * a reference count stored with the string, and sdsfree() releases the
+ * memory only when the last reference is freed. While there is more than
+ * a single reference the string is immutable: the SDS functions that
+ * return a new string pointer, like sdscatlen(), sdsMakeRoomFor(),
+ * sdscpylen(), sdstrim() and sdsrange(), modify a private copy of the
+ * string instead (copy on write), while the functions that modify the
+ * string in place, like sdsclear(), sdsIncrLen() or sdstolower(), require
+ * a private string obtained with sdsunshare().
+ *
+ * The reference count is updated atomically, so references can be freed
+ * by different threads.
+ *
+ * After the call, the passed sds string is no longer valid and all the
+ * references must be substituted with the new pointer returned by the call.
+ * On out of memory NULL is returned and 's' is left untouched. */
+sds sdsshare(sds s) {
+    sds shared;
+
+    if (sdsFlags(s) & SDS_FLAG_SHARED) return s;
+    shared = sdsCreate(s, sdslen(s), sdslen(s), sdsGetAllocator(s), SDS_FLAG_SHARED);
+    if (shared == NULL) return NULL;
+    sdsfree(s);
+    return shared;
+}
+
+/* Return a string that can be modified in place: 's' itself if it is not
+ * referenced by others, otherwise a private copy, dropping the reference
+ * to 's'. Returns NULL on out of memory. */
+sds sdsunshare(sds s) {
+    if (!sdsIsShared(s)) return s;
+    return sdsCopyOnWrite(s, s, sdslen(s), sdslen(s));
 }
 
 /* Set the sds string length to the length as obtained with strlen(), so
@@ -195,29 +556,184 @@ void sdsclear(sds s) {
     s[0] = '\0';
 }
 
+/* Move the header and the content of a SDS_FLAG_OFFSET string back to the
+ * start of its allocation, turning the consumed bytes into free space at
+ * the end of the string. Returns the new string pointer. */
+static sds sdsCompact(sds s) {
+    int hdrlen = sdsHdrSize(s[-1]);
+    sds news = (char*)sdsAllocPtr(s)+sdsPrefixSize(s[-1])+hdrlen;
+    size_t alloc = sdsalloc(s)+(s-news);
+
+    memmove(news-hdrlen, s-hdrlen, hdrlen+sdslen(s)+1);
+    news[-1] &= ~SDS_FLAG_OFFSET;
+    sdssetalloc(news, alloc);
+    return news;
+}
+
+/* Remove the first 'n' bytes of the string, or all of it if it is shorter.
+ * This is the same as sdsrange(s,n,-1), but instead of moving the rest of
+ * the string to the start of the buffer, the header is moved forward just
+ * before the first byte that remains, and the number of consumed bytes is
+ * stored before it (SDS_FLAG_OFFSET): so consuming is O(1) regardless of
+ * the length of the string. This is what network input buffers need,
+ * where the commands are processed and removed from the head while new
+ * data is appended at the tail.
+ *
+ * The consumed space is recovered lazily: by sdsMakeRoomFor() when more
+ * room is needed, or as soon as the consumed bytes are more than the ones
+ * left, so that moving the content back is cheaper than what the previous
+ * calls saved.
+ *
+ * Since the header moves, the call must always be in the form:
+ *
+ * s = sdsconsume(s,n);
+ *
+ * On out of memory, that is only possible for shared strings that must be
+ * copied, NULL is returned and 's' is left untouched. */
+sds sdsconsume(sds s, size_t n) {
+    char type = s[-1] & SDS_TYPE_MASK;
+    int hdrlen = sdsHdrSize(type);
+    size_t len = sdslen(s), alloc, offset, skip;
+    int hasoffset = sdsFlags(s) & SDS_FLAG_OFFSET;
+    sds news;
+
+    if (n > len) n = len;
+    if (n == 0) return s;
+    if (sdsIsShared(s)) return sdsCopyOnWrite(s, s+n, len-n, len-n);
+
+    /* The header moves 'skip' bytes forward: usually the consumed bytes,
+     * but the first time we need room to store the offset. If there is
+     * no room at all, or the type 5 header can't store the flag, fall
+     * back to moving the content. */
+    alloc = sdsalloc(s);
+    skip = (hasoffset || n >= sizeof(size_t)) ? n : sizeof(size_t);
+    if (type == SDS_TYPE_5 || skip-n > alloc-len) {
+        memmove(s, s+n, len-n+1);
+        sdssetlen(s, len-n);
+        return s;
+    }
+    offset = hasoffset ? sdsOffset(s)+skip : skip-sizeof(size_t);
+
+    news = s+skip;
+    if (skip != n) memmove(news, s+n, len-n+1);
+    memmove(news-hdrlen, s-hdrlen, hdrlen);
+    memcpy(news-hdrlen-sizeof(size_t), &offset, sizeof(offset));
+    news[-1] |= SDS_FLAG_OFFSET;
+    sdssetlen(news, len-n);
+    sdssetalloc(news, alloc-skip);
+    if (offset >= len-n) news = sdsCompact(news);
+    return news;
+}
+
+/* Return the new length of a string of 'len' bytes that must be enlarged
+ * in order to hold 'reqlen' bytes, according to the growth policy 'p'.
+ * The returned length is never smaller than 'reqlen'. */
+static size_t sdsGrowthLen(const sdsGrowthPolicy *p, size_t len, size_t reqlen) {
+    size_t newlen = reqlen, extra = 0;
+
+    switch(p->type) {
+    case SDS_GROWTH_EXACT:
+        break;
+    case SDS_GROWTH_DOUBLE:
+        extra = reqlen;
+        break;
+    case SDS_GROWTH_INCR:
+        extra = p->param;
+        break;
+    case SDS_GROWTH_RATIO:
+        extra = reqlen/100*p->param + reqlen%100*p->param/100;
+        if (p->cap && extra > p->cap) extra = p->cap;
+        break;
+    case SDS_GROWTH_FUNC:
+        newlen = p->fn(len,reqlen,p->privdata);
+        break;
+    }
+    newlen += extra;
+    if (newlen < reqlen) newlen = reqlen; /* Overflow or bad callback. */
+    return newlen;
+}
+
+/* Set the growth policy used by sdsMakeRoomFor(), and so by all the
+ * functions appending to strings. If 'policy' is NULL the default policy is
+ * restored, that doubles the required length but never preallocates more
+ * than SDS_MAX_PREALLOC bytes.
+ *
+ * The policy is global and not protected by locks: it should be set when
+ * the program starts, before other threads use SDS. */
+void sdsSetGrowthPolicy(const sdsGrowthPolicy *policy) {
+    sdsGrowth = policy ? *policy : sdsDefaultGrowth;
+}
+
+/* Store the current growth policy into 'policy'. */
+void sdsGetGrowthPolicy(sdsGrowthPolicy *policy) {
+    *policy = sdsGrowth;
+}
+
 /* Enlarge the free space at the end of the sds string so that the caller
  * is sure that after calling this function can overwrite up to addlen
  * bytes after the end of the string, plus one more byte for nul term.
  *
+ * The amount of free space preallocated is decided by the growth policy
+ * set with sdsSetGrowthPolicy().
+ *
  * Note: this does not change the *length* of the sds string as returned
  * by sdslen(), but only the free buffer space we have. */
 sds sdsMakeRoomFor(sds s, size_t addlen) {
+    return sdsMakeRoomForPolicy(s, addlen, &sdsGrowth);
+}
+
+/* Like sdsMakeRoomFor(), but don't preallocate any additional free space:
+ * useful when the final size of the string is known. */
+sds sdsMakeRoomForNonGreedy(sds s, size_t addlen) {
+    return sdsMakeRoomForPolicy(s, addlen, &sdsExactGrowth);
+}
+
+/* Like sdsMakeRoomFor(), but using the growth policy 'policy' for this
+ * call only. */
+sds sdsMakeRoomForPolicy(sds s, size_t addlen, const sdsGrowthPolicy *policy) {
     void *sh, *newsh;
     size_t avail = sdsavail(s);
-    size_t len, newlen, reqlen;
+    size_t len, newlen, reqlen, prefixlen, oldsize;
     char type, oldtype = s[-1] & SDS_TYPE_MASK;
+    unsigned char sflags;
+    sdsAllocator *a;
     int hdrlen;
 
     /* Return ASAP if there is enough space left. */
-    if (avail >= addlen) return s;
+    if (avail >= addlen && !sdsIsShared(s)) return s;
+
+    /* Recover the space consumed from the head, if any. Unless enough
+     * free space is left after the call (as much as the content), grow
+     * the string anyway, or we may move the content at every call. */
+    if (sdsFlags(s) & SDS_FLAG_OFFSET && !sdsIsShared(s)) {
+        s = sdsCompact(s);
+        avail = sdsavail(s);
+        if (avail >= addlen && avail >= sdslen(s)) return s;
+    }
 
     len = sdslen(s);
-    sh = (char*)s-sdsHdrSize(oldtype);
-    reqlen = newlen = (len+addlen);
-    if (newlen < SDS_MAX_PREALLOC)
-        newlen *= 2;
-    else
-        newlen += SDS_MAX_PREALLOC;
+    sh = sdsAllocPtr(s);
+    a = sdsGetAllocator(s);
+    sflags = sdsFlags(s);
+    prefixlen = sdsPrefixSize(s[-1]);
+    oldsize = sdsRawSize(s);
+    reqlen = len+addlen;
+    assert(reqlen >= len); /* Catch size_t overflow */
+    newlen = sdsGrowthLen(policy, len, reqlen);
+
+    /* Strings living in storage not owned by SDS, or referenced by others,
+     * are copied to a new private allocation. */
+    if (sflags & SDS_FLAG_STATIC || sdsIsShared(s))
+        return sdsCopyOnWrite(s, s, len, newlen);
+
+    /* Strings growing past the mmap threshold leave the heap. This is the
+     * last time they are copied: mappings are enlarged by the kernel. */
+    if (a == NULL && sdsMmapThreshold && newlen >= sdsMmapThreshold) {
+        sds news = sdsCreate(s, len, newlen, NULL, sflags & SDS_FLAG_SHARED);
+        if (news == NULL) return NULL;
+        sdsfree(s);
+        return news;
+    }
 
     type = sdsReqType(newlen);
 
@@ -227,24 +743,34 @@ sds sdsMakeRoomFor(sds s, size_t addlen) {
     if (type == SDS_TYPE_5) type = SDS_TYPE_8;
 
     hdrlen = sdsHdrSize(type);
-    assert(hdrlen + newlen + 1 > reqlen); /* Catch size_t overflow */
+    assert(prefixlen + hdrlen + newlen + 1 > reqlen); /* Catch size_t overflow */
+    sdsStatsDel(s);
     if (oldtype==type) {
-        newsh = s_realloc(sh, hdrlen+newlen+1);
-        if (newsh == NULL) return NULL;
-        s = (char*)newsh+hdrlen;
+        newsh = sdsRawRealloc(a, sh, oldsize, prefixlen+hdrlen+newlen+1);
+        if (newsh == NULL) goto oom;
+        s = (char*)newsh+prefixlen+hdrlen;
     } else {
         /* Since the header size changes, need to move the string forward,
          * and can't use realloc */
-        newsh = s_malloc(hdrlen+newlen+1);
-        if (newsh == NULL) return NULL;
-        memcpy((char*)newsh+hdrlen, s, len+1);
-        s_free(sh);
-        s = (char*)newsh+hdrlen;
-        s[-1] = type;
+        newsh = sdsRawAlloc(a, prefixlen+hdrlen+newlen+1);
+        if (newsh == NULL) goto oom;
+        memcpy(newsh, sh, prefixlen);
+        memcpy((char*)newsh+prefixlen+hdrlen, s, len+1);
+        sdsRawFree(a, sh, oldsize);
+        s = (char*)newsh+prefixlen+hdrlen;
+        s[-1] = type | sflags;
         sdssetlen(s, len);
+        sdsStatsIncr(upgrades,1);
     }
-    sdssetalloc(s, newlen);
+    sdsSetUsableAlloc(s, a, newsh, prefixlen+hdrlen+newlen+1);
+    sdsStatsAdd(s);
+    sdsStatsIncr(reallocs,1);
+    sdsStatsIncr(prealloc_bytes,sdsalloc(s)-reqlen);
     return s;
+
+oom:
+    sdsStatsAdd(s); /* The original string is still valid. */
+    return NULL;
 }
 
 /* Reallocate the sds string so that it has no free space at the end. The
@@ -255,57 +781,159 @@ sds sdsMakeRoomFor(sds s, size_t addlen) {
  * references must be substituted with the new pointer returned by the call. */
 sds sdsRemoveFreeSpace(sds s) {
     void *sh, *newsh;
-    char type, oldtype = s[-1] & SDS_TYPE_MASK;
-    int hdrlen, oldhdrlen = sdsHdrSize(oldtype);
-    size_t len = sdslen(s);
-    size_t avail = sdsavail(s);
-    sh = (char*)s-oldhdrlen;
+    char type, oldtype;
+    int hdrlen, oldhdrlen;
+    size_t len, avail, prefixlen, oldsize;
+    unsigned char sflags;
+    sdsAllocator *a;
+
+    if (sdsFlags(s) & SDS_FLAG_OFFSET && !sdsIsShared(s)) s = sdsCompact(s);
+    oldtype = s[-1] & SDS_TYPE_MASK;
+    oldhdrlen = sdsHdrSize(oldtype);
+    len = sdslen(s);
+    avail = sdsavail(s);
+    prefixlen = sdsPrefixSize(s[-1]);
+    oldsize = sdsRawSize(s);
+    sflags = sdsFlags(s);
+    a = sdsGetAllocator(s);
+    sh = sdsAllocPtr(s);
 
-    /* Return ASAP if there is no space left. */
-    if (avail == 0) return s;
+    /* Return ASAP if there is no space left, if the memory is not owned
+     * by SDS, or if other references to the string exist. */
+    if (avail == 0 || sflags & SDS_FLAG_STATIC || sdsIsShared(s)) return s;
 
     /* Check what would be the minimum SDS header that is just good enough to
      * fit this string. */
     type = sdsReqType(len);
+    if (type == SDS_TYPE_5 && sflags) type = SDS_TYPE_8;
     hdrlen = sdsHdrSize(type);
 
     /* If the type is the same, or at least a large enough type is still
      * required, we just realloc(), letting the allocator to do the copy
      * only if really needed. Otherwise if the change is huge, we manually
      * reallocate the string to use the different header type. */
+    sdsStatsDel(s);
     if (oldtype==type || type > SDS_TYPE_8) {
-        newsh = s_realloc(sh, oldhdrlen+len+1);
-        if (newsh == NULL) return NULL;
-        s = (char*)newsh+oldhdrlen;
+        newsh = sdsRawRealloc(a, sh, oldsize, prefixlen+oldhdrlen+len+1);
+        if (newsh == NULL) goto oom;
+        s = (char*)newsh+prefixlen+oldhdrlen;
+        hdrlen = oldhdrlen;
     } else {
-        newsh = s_malloc(hdrlen+len+1);
-        if (newsh == NULL) return NULL;
-        memcpy((char*)newsh+hdrlen, s, len+1);
-        s_free(sh);
-        s = (char*)newsh+hdrlen;
-        s[-1] = type;
+        newsh = sdsRawAlloc(a, prefixlen+hdrlen+len+1);
+        if (newsh == NULL) goto oom;
+        memcpy(newsh, sh, prefixlen);
+        memcpy((char*)newsh+prefixlen+hdrlen, s, len+1);
+        sdsRawFree(a, sh, oldsize);
+        s = (char*)newsh+prefixlen+hdrlen;
+        s[-1] = type | sflags;
         sdssetlen(s, len);
     }
-    sdssetalloc(s, len);
+    if ((s[-1]&SDS_TYPE_MASK) != SDS_TYPE_5)
+        sdsSetUsableAlloc(s, a, newsh, prefixlen+hdrlen+len+1);
+    sdsStatsAdd(s);
+    if (sdsavail(s) < avail) sdsStatsIncr(reclaimed_bytes,avail-sdsavail(s));
     return s;
+
+oom:
+    sdsStatsAdd(s); /* The original string is still valid. */
+    return NULL;
 }
 
 /* Return the total size of the allocation of the specified sds string,
  * including:
- * 1) The sds header before the pointer.
- * 2) The string.
- * 3) The free buffer at the end if any.
- * 4) The implicit null term.
+ * 1) The allocator context and other data stored before the header, if any.
+ * 2) The sds header before the pointer.
+ * 3) The string.
+ * 4) The free buffer at the end if any.
+ * 5) The implicit null term.
+ * 6) Any slack at the end of the allocation, when the allocator is able
+ *    to report the usable size of its blocks.
  */
 size_t sdsAllocSize(sds s) {
-    size_t alloc = sdsalloc(s);
-    return sdsHdrSize(s[-1])+alloc+1;
+    if (sdsFlags(s) & SDS_FLAG_STATIC) return sdsRawSize(s);
+    return sdsRawUsable(sdsGetAllocator(s), sdsAllocPtr(s), sdsRawSize(s));
 }
 
 /* Return the pointer of the actual SDS allocation (normally SDS strings
  * are referenced by the start of the string buffer). */
 void *sdsAllocPtr(sds s) {
-    return (void*) (s-sdsHdrSize(s[-1]));
+    return (void*) (s-sdsHdrSize(s[-1])-sdsPrefixLen(s));
+}
+
+/* Return the allocator context the string 's' was created with, or NULL
+ * if the string uses the default allocator defined in sdsalloc.h. */
+sdsAllocator *sdsGetAllocator(const sds s) {
+    sdsAllocator *a;
+
+    if (!(sdsFlags(s) & SDS_FLAG_CTX)) return NULL;
+    /* Not always aligned: see sdsMapFile(). */
+    memcpy(&a,sdsAllocPtr(s),sizeof(a));
+    return a;
+}
+
+/* Return the number of references to the string 's', that is always 1 for
+ * strings that are not shared, see sdsshare(). */
+size_t sdsRefCount(const sds s) {
+    if (!(sdsFlags(s) & SDS_FLAG_SHARED)) return 1;
+    return __atomic_load_n(sdsRefCountPtr(s),__ATOMIC_ACQUIRE);
+}
+
+/* Move the string 's' into a new allocation, in order to reduce the
+ * memory fragmentation of long running programs: the allocator usually
+ * knows that a block lives in a page that is mostly unused, and moving it
+ * elsewhere eventually allows to release the page.
+ *
+ * The 'should_move' callback is called with the pointer to the current
+ * allocation of the string (see sdsAllocPtr()) and 'privdata', and should
+ * return non zero if the block is worth moving. If 'should_move' is NULL
+ * the string is always moved.
+ *
+ * The function returns the new string pointer, that is the same as 's'
+ * if the string was not moved or on out of memory. So the call is
+ * always in the form:
+ *
+ * s = sdsDefrag(s,myAllocatorHint,NULL);
+ */
+sds sdsDefrag(sds s, int (*should_move)(void *ptr, void *privdata), void *privdata) {
+    sdsAllocator *a = sdsGetAllocator(s);
+    void *sh = sdsAllocPtr(s), *newsh;
+    size_t size = sdsRawSize(s);
+    size_t used = (s-(char*)sh)+sdslen(s)+1;
+
+    if (sdsFlags(s) & SDS_FLAG_STATIC || sdsIsShared(s)) return s;
+    if (a == &sdsMmapCtx) return s; /* Not part of any heap. */
+    if (should_move && !should_move(sh,privdata)) return s;
+
+    newsh = a ? a->alloc(a,size) : s_malloc_defrag(size);
+    if (newsh == NULL) return s;
+    sdsStatsDel(s);
+    memcpy(newsh,sh,used);
+    if (a)
+        a->release(a,sh,size);
+    else
+        s_free_defrag(sh);
+    s = (char*)newsh+(s-(char*)sh);
+    if (sdsFlags(s) & SDS_FLAG_OFFSET) s = sdsCompact(s);
+    if ((s[-1]&SDS_TYPE_MASK) != SDS_TYPE_5)
+        sdsSetUsableAlloc(s, a, newsh, size);
+    sdsStatsAdd(s);
+    return s;
+}
+
+/* Call sdsDefrag() against the 'count' strings of 'array', that are updated
+ * in place with the new pointers. NULL elements are skipped. Returns the
+ * number of strings moved. */
+size_t sdsDefragArray(sds *array, size_t count, int (*should_move)(void *ptr, void *privdata), void *privdata) {
+    size_t j, moved = 0;
+
+    for (j = 0; j < count; j++) {
+        sds s = array[j];
+
+        if (s == NULL) continue;
+        array[j] = sdsDefrag(s,should_move,privdata);
+        if (array[j] != s) moved++;
+    }
+    return moved;
 }
 
 /* Increment the sds length and decrements the left free space at the
@@ -425,6 +1053,7 @@ sds sdscatsds(sds s, const sds t) {
 /* Destructively modify the sds string 's' to hold the specified binary
  * safe string pointed by 't' of length 'len' bytes. */
 sds sdscpylen(sds s, const char *t, size_t len) {
+    if (sdsIsShared(s)) return sdsCopyOnWrite(s, t, len, len);
     if (sdsalloc(s) < len) {
         s = sdsMakeRoomFor(s,len-sdslen(s));
         if (s == NULL) return NULL;
@@ -614,16 +1243,24 @@ sds sdscatprintf(sds s, const char *fmt, ...) {
  * %% - Verbatim "%" character.
  */
 sds sdscatfmt(sds s, char const *fmt, ...) {
+    va_list ap;
+
+    va_start(ap,fmt);
+    s = sdscatvfmt(s,fmt,ap);
+    va_end(ap);
+    return s;
+}
+
+/* Like sdscatfmt() but getting the arguments as a va_list. */
+sds sdscatvfmt(sds s, char const *fmt, va_list ap) {
     size_t initlen = sdslen(s);
     const char *f = fmt;
     long i;
-    va_list ap;
 
     /* To avoid continuous reallocations, let's start with a buffer that
      * can hold at least two times the format string itself. It's not the
      * best heuristic but seems to work in practice. */
     s = sdsMakeRoomFor(s, initlen + strlen(fmt)*2);
-    va_start(ap,fmt);
     f = fmt;    /* Next format specifier byte to process. */
     i = initlen; /* Position of the next byte to write to dest str. */
     while(*f) {
@@ -701,15 +1338,60 @@ sds sdscatfmt(sds s, char const *fmt, ...) {
         }
         f++;
     }
-    va_end(ap);
 
     /* Add null-term */
     s[i] = '\0';
     return s;
 }
 
+/* A set of bytes, stored as a 256 bit bitmap: checking if a byte is in the
+ * set costs a shift and a mask, whatever the size of the set, while calling
+ * strchr() for every byte costs a function call and a scan of the set. */
+typedef struct sdsByteSet {
+    uint64_t bits[4];
+} sdsByteSet;
+
+static void sdsByteSetInit(sdsByteSet *set, const char *cset, size_t setlen) {
+    memset(set,0,sizeof(*set));
+    while(setlen--) {
+        unsigned char c = *cset++;
+        set->bits[c>>6] |= (uint64_t)1 << (c&63);
+    }
+}
+
+static inline int sdsByteSetHas(const sdsByteSet *set, unsigned char c) {
+    return (set->bits[c>>6] >> (c&63)) & 1;
+}
+
+/* Return the part of 'v' left after removing the bytes of 'set' from the
+ * left of the view, if 'left' is true, and from the right, if 'right' is
+ * true. */
+static sdsview sdsTrimView(sdsview v, const sdsByteSet *set, int left, int right) {
+    const unsigned char *sp = (const unsigned char*)v.ptr, *ep = sp+v.len;
+
+    if (left) while(sp < ep && sdsByteSetHas(set,*sp)) sp++;
+    if (right) while(ep > sp && sdsByteSetHas(set,*(ep-1))) ep--;
+    return sdsviewlen(sp,ep-sp);
+}
+
+/* Trim the string 's' with the 'setlen' bytes of 'cset', see sdsTrimView(). */
+static sds sdsTrim(sds s, const char *cset, size_t setlen, int left, int right) {
+    sdsByteSet set;
+    sdsview v;
+
+    sdsByteSetInit(&set,cset,setlen);
+    v = sdsTrimView(sdsviewsds(s),&set,left,right);
+    if (sdsIsShared(s)) return sdsCopyOnWrite(s, v.ptr, v.len, v.len);
+    if (v.ptr != s) memmove(s, v.ptr, v.len);
+    s[v.len] = '\0';
+    sdssetlen(s,v.len);
+    return s;
+}
+
 /* Remove the part of the string from left and from right composed just of
  * contiguous characters found in 'cset', that is a null terminated C string.
+ * Like strchr() does, the null term is considered part of the set, so null
+ * bytes are always trimmed: use sdstrimlen() to trim an exact set of bytes.
  *
  * After the call, the modified sds string is no longer valid and all the
  * references must be substituted with the new pointer returned by the call.
@@ -723,40 +1405,33 @@ sds sdscatfmt(sds s, char const *fmt, ...) {
  * Output will be just "HelloWorld".
  */
 sds sdstrim(sds s, const char *cset) {
-    char *end, *sp, *ep;
-    size_t len;
+    return sdsTrim(s,cset,strlen(cset)+1,1,1);
+}
 
-    sp = s;
-    ep = end = s+sdslen(s)-1;
-    while(sp <= end && strchr(cset, *sp)) sp++;
-    while(ep > sp && strchr(cset, *ep)) ep--;
-    len = (ep-sp)+1;
-    if (s != sp) memmove(s, sp, len);
-    s[len] = '\0';
-    sdssetlen(s,len);
-    return s;
+/* Like sdstrim(), but the set is composed of the 'setlen' bytes at 'cset',
+ * that can contain any byte, null included. */
+sds sdstrimlen(sds s, const char *cset, size_t setlen) {
+    return sdsTrim(s,cset,setlen,1,1);
 }
 
-/* Turn the string into a smaller (or equal) string containing only the
- * substring specified by the 'start' and 'end' indexes.
- *
- * start and end can be negative, where -1 means the last character of the
- * string, -2 the penultimate character, and so forth.
- *
- * The interval is inclusive, so the start and end characters will be part
- * of the resulting string.
- *
- * The string is modified in-place.
- *
- * Example:
- *
- * s = sdsnew("Hello World");
- * sdsrange(s,1,-1); => "ello World"
- */
-void sdsrange(sds s, ssize_t start, ssize_t end) {
-    size_t newlen, len = sdslen(s);
+/* Like sdstrim(), but only remove the characters at the left. */
+sds sdsltrim(sds s, const char *cset) {
+    return sdsTrim(s,cset,strlen(cset)+1,1,0);
+}
+
+/* Like sdstrim(), but only remove the characters at the right. */
+sds sdsrtrim(sds s, const char *cset) {
+    return sdsTrim(s,cset,strlen(cset)+1,0,1);
+}
+
+/* Normalize the inclusive range 'start'-'end' of a string of 'len' bytes,
+ * as described in sdsrange(): negative indexes count from the end and
+ * indexes out of the string are clamped. Returns the length of the range,
+ * and sets '*start' to its offset, or to 0 if the range is empty. */
+static size_t sdsRangeNormalize(size_t len, ssize_t *startp, ssize_t end) {
+    ssize_t start = *startp;
+    size_t newlen;
 
-    if (len == 0) return;
     if (start < 0) {
         start = len+start;
         if (start < 0) start = 0;
@@ -774,28 +1449,99 @@ void sdsrange(sds s, ssize_t start, ssize_t end) {
             newlen = (end-start)+1;
         }
     }
-    if (start && newlen) memmove(s, s+start, newlen);
-    s[newlen] = 0;
-    sdssetlen(s,newlen);
-}
-
-/* Apply tolower() to every character of the sds string 's'. */
-void sdstolower(sds s) {
-    size_t len = sdslen(s), j;
-
-    for (j = 0; j < len; j++) s[j] = tolower(s[j]);
-}
-
-/* Apply toupper() to every character of the sds string 's'. */
-void sdstoupper(sds s) {
-    size_t len = sdslen(s), j;
-
-    for (j = 0; j < len; j++) s[j] = toupper(s[j]);
+    *startp = newlen ? start : 0;
+    return newlen;
 }
 
-/* Compare two sds strings s1 and s2 with memcmp().
- *
- * Return value:
+/* Turn the string into a smaller (or equal) string containing only the
+ * substring specified by the 'start' and 'end' indexes.
+ *
+ * start and end can be negative, where -1 means the last character of the
+ * string, -2 the penultimate character, and so forth.
+ *
+ * The interval is inclusive, so the start and end characters will be part
+ * of the resulting string.
+ *
+ * The string is modified in-place, and the same pointer is returned, unless
+ * it is a shared string referenced by others (see sdsshare()): in this
+ * case the substring is copied into a new string that is returned (or NULL
+ * on out of memory), so when shared strings are used the call must be in
+ * the form s = sdsrange(s,...).
+ *
+ * Example:
+ *
+ * s = sdsnew("Hello World");
+ * sdsrange(s,1,-1); => "ello World"
+ */
+sds sdsrange(sds s, ssize_t start, ssize_t end) {
+    size_t newlen, len = sdslen(s);
+
+    if (len == 0) return s;
+    newlen = sdsRangeNormalize(len,&start,end);
+    if (sdsIsShared(s))
+        return sdsCopyOnWrite(s, s+start, newlen, newlen);
+    if (start && newlen) memmove(s, s+start, newlen);
+    s[newlen] = 0;
+    sdssetlen(s,newlen);
+    return s;
+}
+
+/* ASCII case conversion. Protocol keywords and header names are ASCII, so
+ * instead of calling the locale aware tolower() and toupper() for every
+ * byte, the letters are converted eight bytes at a time using plain 64 bit
+ * arithmetic (SWAR, SIMD within a register): this works on every target,
+ * and compilers are able to vectorize it further. */
+#define SDS_SWAR_ONES 0x0101010101010101ULL
+
+/* Return a word having the bytes of 'w' that are in the range of ASCII
+ * letters [first,last] set to 0x20, and the others to zero. Adding the
+ * constants to the low 7 bits of every byte sets the high bit of the bytes
+ * >= first and > last respectively, without ever carrying into the next
+ * byte. Bytes having the high bit set are not ASCII and never match. */
+static inline uint64_t sdsCaseMask(uint64_t w, unsigned char first, unsigned char last) {
+    uint64_t low = w & (SDS_SWAR_ONES*0x7f);
+    uint64_t ge = low + SDS_SWAR_ONES*(0x80-first);
+    uint64_t gt = low + SDS_SWAR_ONES*(0x7f-last);
+
+    return (~w & (ge ^ gt) & (SDS_SWAR_ONES*0x80)) >> 2;
+}
+
+/* Flip the case of the bytes of 'p' in the range of ASCII letters
+ * [first,last]. */
+static void sdsCaseConvert(char *p, size_t len, unsigned char first, unsigned char last) {
+    size_t j = 0;
+
+    for (; j+8 <= len; j += 8) {
+        uint64_t w;
+
+        memcpy(&w,p+j,sizeof(w));
+        w ^= sdsCaseMask(w,first,last);
+        memcpy(p+j,&w,sizeof(w));
+    }
+    for (; j < len; j++) {
+        unsigned char c = p[j];
+        if (c >= first && c <= last) p[j] = c^0x20;
+    }
+}
+
+static inline unsigned char sdsAsciiLower(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c|0x20 : c;
+}
+
+/* Turn the ASCII letters of the sds string 's' to lower case. Unlike
+ * tolower(), other bytes are never changed, whatever the locale is. */
+void sdstolower(sds s) {
+    sdsCaseConvert(s,sdslen(s),'A','Z');
+}
+
+/* Turn the ASCII letters of the sds string 's' to upper case. */
+void sdstoupper(sds s) {
+    sdsCaseConvert(s,sdslen(s),'a','z');
+}
+
+/* Compare two sds strings s1 and s2 with memcmp().
+ *
+ * Return value:
  *
  *     positive if s1 > s2.
  *     negative if s1 < s2.
@@ -816,6 +1562,264 @@ int sdscmp(const sds s1, const sds s2) {
     return cmp;
 }
 
+/* Substring search.
+ *
+ * Short needles are searched using memchr(), that the libc implements with
+ * vector instructions, in order to find the candidate positions matching
+ * the first byte of the needle, that are then filtered checking the last
+ * byte, and finally verified with memcmp(). This is the fastest approach
+ * in practice, but with adversarial inputs (say, a needle like "aaab" in a
+ * haystack full of "a") memchr() degrades to a slow byte by byte loop, and
+ * the verification work can grow with the product of the two lengths: when
+ * the wasted work exceeds the bytes scanned so far, and for long needles,
+ * the search switches to the Two-Way algorithm of Crochemore and Perrin,
+ * that runs in linear time and constant space. */
+#define SDS_TWOWAY_MIN_LEN 32
+
+#define SDS_BITSET_HAS(set,c) \
+    ((set)[(c)/(8*sizeof(size_t))] & ((size_t)1 << ((c)%(8*sizeof(size_t)))))
+#define SDS_BITSET_ADD(set,c) \
+    ((set)[(c)/(8*sizeof(size_t))] |= ((size_t)1 << ((c)%(8*sizeof(size_t)))))
+
+/* The Two-Way functions below access the haystack and the needle through
+ * this macro, so that with a 'dir' of -1 they search the mirrored strings,
+ * starting at their last byte and going backward, without copying them. */
+#define SDS_TW_AT(p,i) ((p)[(ssize_t)(i)*dir])
+
+/* The body of the search is instantiated for every direction, where 'dir'
+ * is a constant, only if it is inlined. */
+#ifdef __GNUC__
+#define SDS_TW_INLINE inline __attribute__((always_inline))
+#else
+#define SDS_TW_INLINE inline
+#endif
+
+/* Compute the maximal suffix of the needle 'n' of 'len' bytes according to
+ * the byte ordering (if 'reverse' is false) or its opposite, returning the
+ * position before the suffix, and storing its period into '*period'. */
+static SDS_TW_INLINE size_t sdsMaxSuffix(const unsigned char *n, size_t len, int dir, int reverse, size_t *period) {
+    size_t i = (size_t)-1, j = 0, k = 1, p = 1;
+
+    while(j+k < len) {
+        unsigned char a = SDS_TW_AT(n,i+k), b = SDS_TW_AT(n,j+k);
+
+        if (a == b) {
+            if (k == p) {
+                j += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (reverse ? a < b : a > b) {
+            j += k;
+            k = 1;
+            p = j-i;
+        } else {
+            i = j++;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return i;
+}
+
+/* Two-Way search of the needle 'n' of 'nlen' bytes in 'h' of 'hlen' bytes.
+ * The needle is split in two halves at its critical factorization: the right
+ * half is compared first, left to right, and on mismatch the search skips as
+ * many bytes as matched; then the left half, right to left, and on mismatch
+ * the search skips a period of the needle. Moreover a table of the last
+ * position of every byte in the needle allows to skip quickly the positions
+ * where the last byte of the window can't be part of a match.
+ *
+ * With a 'dir' of 1 the offset of the first occurrence is returned. With a
+ * 'dir' of -1, 'h' and 'n' point to the last byte of the two strings, and
+ * the offset of the first occurrence in the mirrored strings is returned,
+ * that is, the distance of the last occurrence from the end of 'h'. */
+static SDS_TW_INLINE ssize_t sdsTwoWay(const unsigned char *h, size_t hlen, const unsigned char *n, size_t nlen, int dir) {
+    size_t byteset[32/sizeof(size_t)] = {0};
+    size_t shift[256];
+    size_t i, k, p, p0, ms, ms0, mem, mem0, pos = 0;
+
+    for (i = 0; i < nlen; i++) {
+        SDS_BITSET_ADD(byteset,SDS_TW_AT(n,i));
+        shift[SDS_TW_AT(n,i)] = i+1;
+    }
+
+    /* The critical factorization is the longest of the two maximal suffixes
+     * computed with the two opposite orderings. */
+    ms0 = sdsMaxSuffix(n,nlen,dir,0,&p0);
+    ms = sdsMaxSuffix(n,nlen,dir,1,&p);
+    if (ms+1 <= ms0+1) {
+        ms = ms0;
+        p = p0;
+    }
+
+    /* If the needle is periodic, the bytes known to match after a shift of
+     * a period are remembered in 'mem' and not compared again. */
+    for (k = 0; k < ms+1 && SDS_TW_AT(n,k) == SDS_TW_AT(n,k+p); k++);
+    if (k < ms+1) {
+        mem0 = 0;
+        p = (ms > nlen-ms-1 ? ms : nlen-ms-1)+1;
+    } else {
+        mem0 = nlen-p;
+    }
+    mem = 0;
+
+    while(hlen-pos >= nlen) {
+        /* Check the last byte of the window first. */
+        unsigned char last = SDS_TW_AT(h,pos+nlen-1);
+        if (!SDS_BITSET_HAS(byteset,last)) {
+            pos += nlen;
+            mem = 0;
+            continue;
+        }
+        k = nlen-shift[last];
+        if (k) {
+            if (k < mem) k = mem;
+            pos += k;
+            mem = 0;
+            continue;
+        }
+
+        /* Compare the right half. */
+        for (k = (ms+1 > mem ? ms+1 : mem);
+             k < nlen && SDS_TW_AT(n,k) == SDS_TW_AT(h,pos+k); k++);
+        if (k < nlen) {
+            pos += k-ms;
+            mem = 0;
+            continue;
+        }
+        /* Compare the left half. */
+        for (k = ms+1; k > mem && SDS_TW_AT(n,k-1) == SDS_TW_AT(h,pos+k-1); k--);
+        if (k <= mem) return pos;
+        pos += p;
+        mem = mem0;
+    }
+    return -1;
+}
+
+/* The two directions of the Two-Way search, each one an instance of the
+ * function above where the direction is a constant. */
+static ssize_t sdsTwoWayForward(const unsigned char *h, size_t hlen, const unsigned char *n, size_t nlen) {
+    return sdsTwoWay(h,hlen,n,nlen,1);
+}
+
+static ssize_t sdsTwoWayBackward(const unsigned char *h, size_t hlen, const unsigned char *n, size_t nlen) {
+    return sdsTwoWay(h,hlen,n,nlen,-1);
+}
+
+/* Return the offset of the first occurrence of the needle 'n' of 'nlen'
+ * bytes in 'h' of 'hlen' bytes, or -1 if it is not found. */
+static ssize_t sdsFindMem(const char *h, size_t hlen, const char *n, size_t nlen) {
+    const unsigned char *uh = (const unsigned char*)h;
+    const unsigned char *un = (const unsigned char*)n;
+    const char *p = h, *last;
+    size_t wasted = 0;
+
+    if (nlen == 0) return 0;
+    if (nlen > hlen) return -1;
+    if (nlen == 1) {
+        p = memchr(h,n[0],hlen);
+        return p ? p-h : -1;
+    }
+    if (nlen >= SDS_TWOWAY_MIN_LEN) return sdsTwoWayForward(uh,hlen,un,nlen);
+
+    last = h+hlen-nlen; /* Last position where the needle may start. */
+    while(p <= last) {
+        p = memchr(p,n[0],last-p+1);
+        if (p == NULL) return -1;
+        if (p[nlen-1] == n[nlen-1]) {
+            if (memcmp(p+1,n+1,nlen-2) == 0) return p-h;
+            wasted += nlen;
+        }
+        /* Every false candidate costs a memchr() call as well. */
+        wasted += 8;
+        if (wasted > (size_t)(p-h)+256) {
+            ssize_t j = sdsTwoWayForward(uh+(p-h),hlen-(p-h),un,nlen);
+            return j == -1 ? -1 : (p-h)+j;
+        }
+        p++;
+    }
+    return -1;
+}
+
+/* Return the offset of the last occurrence of the needle 'n' of 'nlen'
+ * bytes in 'h' of 'hlen' bytes, or -1 if it is not found. This is the
+ * mirror of sdsFindMem(): the haystack is scanned backward, comparing the
+ * needle only where its first and last bytes match, and the search switches
+ * to the Two-Way algorithm, run on the mirrored strings, for long needles
+ * and when the wasted work exceeds the bytes scanned so far. */
+static ssize_t sdsRFindMem(const char *h, size_t hlen, const char *n, size_t nlen) {
+    const unsigned char *uh = (const unsigned char*)h;
+    const unsigned char *un = (const unsigned char*)n;
+    size_t pos, wasted = 0;
+    ssize_t j;
+
+    if (nlen == 0) return hlen;
+    if (nlen > hlen) return -1;
+    if (nlen >= SDS_TWOWAY_MIN_LEN) {
+        j = sdsTwoWayBackward(uh+hlen-1,hlen,un+nlen-1,nlen);
+        return j == -1 ? -1 : (ssize_t)(hlen-nlen)-j;
+    }
+
+    pos = hlen-nlen; /* Last position where the needle may start. */
+    while(1) {
+        if (h[pos] == n[0] && h[pos+nlen-1] == n[nlen-1]) {
+            if (memcmp(h+pos,n,nlen) == 0) return pos;
+            wasted += nlen;
+            if (wasted > hlen-nlen-pos+256) {
+                /* Only the occurrences starting at or before 'pos' are
+                 * left, that are all contained in its first bytes. */
+                j = sdsTwoWayBackward(uh+pos+nlen-1,pos+nlen,un+nlen-1,nlen);
+                return j == -1 ? -1 : (ssize_t)pos-j;
+            }
+        }
+        if (pos == 0) break;
+        pos--;
+    }
+    return -1;
+}
+
+/* Return the offset of the first occurrence of the null terminated string
+ * 'needle' in the sds string 's', or -1 if it is not found. An empty
+ * needle is found at offset zero.
+ *
+ * Example:
+ *
+ * s = sdsnew("GET /index.html HTTP/1.1\r\n");
+ * sdsfind(s,"HTTP/"); => 16
+ */
+ssize_t sdsfind(const sds s, const char *needle) {
+    return sdsFindMem(s,sdslen(s),needle,strlen(needle));
+}
+
+/* Like sdsfind() but the needle is the binary safe string of 'len' bytes
+ * at 'needle'. */
+ssize_t sdsfindlen(const sds s, const void *needle, size_t len) {
+    return sdsFindMem(s,sdslen(s),needle,len);
+}
+
+/* Return the offset of the last occurrence of the null terminated string
+ * 'needle' in the sds string 's', or -1 if it is not found. An empty
+ * needle is found at the end of the string. */
+ssize_t sdsrfind(const sds s, const char *needle) {
+    return sdsRFindMem(s,sdslen(s),needle,strlen(needle));
+}
+
+/* Like sdsrfind() but the needle is the binary safe string of 'len' bytes
+ * at 'needle'. */
+ssize_t sdsrfindlen(const sds s, const void *needle, size_t len) {
+    return sdsRFindMem(s,sdslen(s),needle,len);
+}
+
+/* Return the offset of the first occurrence of the separator 'sep' of
+ * 'seplen' bytes in 's', starting the search at 'start', or -1 if the
+ * separator is not found before 'len'. */
+static long sdsSplitFind(const char *s, long len, long start, const char *sep, int seplen) {
+    ssize_t j = sdsFindMem(s+start,len-start,sep,seplen);
+    return j == -1 ? -1 : start+j;
+}
+
 /* Split 's' with separator in 'sep'. An array
  * of sds strings is returned. *count will be set
  * by reference to the number of tokens returned.
@@ -833,89 +1837,363 @@ int sdscmp(const sds s1, const sds s2) {
  * same function but for zero-terminated strings.
  */
 sds *sdssplitlen(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
-    int elements = 0, slots = 5;
-    long start = 0, j;
+    return sdssplitlenctx(s,len,sep,seplen,count,NULL);
+}
+
+/* Like sdssplitlen() but both the tokens and the returned array are
+ * allocated using the allocator context 'a', so that, for instance, the
+ * whole result of the split lives inside an arena. The result must be
+ * freed with sdsfreesplitresctx() using the same context, or, for an arena,
+ * just dropped when the arena is reset. Only the temporary array of views
+ * used while splitting comes from the default allocator. If 'a' is NULL
+ * this is exactly like sdssplitlen(). */
+sds *sdssplitlenctx(const char *s, ssize_t len, const char *sep, int seplen, int *count, sdsAllocator *a) {
+    sdsview *views;
     sds *tokens;
+    int elements;
 
-    if (seplen < 1 || len <= 0) {
-        *count = 0;
-        return NULL;
+    /* Split into views first, so that both the functions share the same
+     * splitting loop, and the array can be allocated with the exact size,
+     * that is also what sdsfreesplitresctx() passes to the context. */
+    views = sdssplitview(s,len,sep,seplen,count);
+    if (views == NULL) return NULL;
+
+    tokens = sdsRawAlloc(a,sizeof(sds)*(*count));
+    if (tokens == NULL) goto cleanup;
+    for (elements = 0; elements < *count; elements++) {
+        tokens[elements] = sdsnewlenctx(views[elements].ptr,views[elements].len,a);
+        if (tokens[elements] == NULL) {
+            while(elements--) sdsfree(tokens[elements]);
+            sdsRawFree(a,tokens,sizeof(sds)*(*count));
+            goto cleanup;
+        }
     }
+    sdsfreesplitview(views);
+    return tokens;
+
+cleanup:
+    sdsfreesplitview(views);
+    *count = 0;
+    return NULL;
+}
+
+/* Free the result returned by sdssplitlen(), or do nothing if 'tokens' is NULL. */
+void sdsfreesplitres(sds *tokens, int count) {
+    sdsfreesplitresctx(tokens,count,NULL);
+}
 
-    tokens = s_malloc(sizeof(sds)*slots);
+/* Free the result returned by sdssplitlenctx() with the allocator context
+ * 'a', or do nothing if 'tokens' is NULL. */
+void sdsfreesplitresctx(sds *tokens, int count, sdsAllocator *a) {
+    int j = count;
+
+    if (!tokens) return;
+    while(j--)
+        sdsfree(tokens[j]);
+    sdsRawFree(a,tokens,sizeof(sds)*count);
+}
+
+/* Like sdssplitlen() but the tokens are returned as views of 's' instead
+ * of new strings, so a single allocation is performed regardless of the
+ * number of tokens. The views are valid as long as 's' is not modified or
+ * freed. The returned array is freed with sdsfreesplitview().
+ *
+ * On out of memory, zero length string, zero length separator, NULL is
+ * returned. */
+sdsview *sdssplitview(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
+    int elements = 0, slots = 5;
+    long start = 0, j;
+    sdsview *tokens;
+
+    *count = 0;
+    if (seplen < 1 || len <= 0) return NULL;
+
+    tokens = s_malloc(sizeof(sdsview)*slots);
     if (tokens == NULL) return NULL;
 
-    for (j = 0; j < (len-(seplen-1)); j++) {
+    while((j = sdsSplitFind(s,len,start,sep,seplen)) != -1) {
         /* make sure there is room for the next element and the final one */
         if (slots < elements+2) {
-            sds *newtokens;
+            sdsview *newtokens;
 
             slots *= 2;
-            newtokens = s_realloc(tokens,sizeof(sds)*slots);
-            if (newtokens == NULL) goto cleanup;
+            newtokens = s_realloc(tokens,sizeof(sdsview)*slots);
+            if (newtokens == NULL) {
+                s_free(tokens);
+                return NULL;
+            }
             tokens = newtokens;
         }
-        /* search the separator */
-        if ((seplen == 1 && *(s+j) == sep[0]) || (memcmp(s+j,sep,seplen) == 0)) {
-            tokens[elements] = sdsnewlen(s+start,j-start);
-            if (tokens[elements] == NULL) goto cleanup;
-            elements++;
-            start = j+seplen;
-            j = j+seplen-1; /* skip the separator */
-        }
+        tokens[elements++] = sdsviewlen(s+start,j-start);
+        start = j+seplen;
     }
     /* Add the final element. We are sure there is room in the tokens array. */
-    tokens[elements] = sdsnewlen(s+start,len-start);
-    if (tokens[elements] == NULL) goto cleanup;
-    elements++;
+    tokens[elements++] = sdsviewlen(s+start,len-start);
     *count = elements;
     return tokens;
+}
 
-cleanup:
-    {
-        int i;
-        for (i = 0; i < elements; i++) sdsfree(tokens[i]);
-        s_free(tokens);
-        *count = 0;
-        return NULL;
+/* Like sdssplitlen() but the array and all the tokens are stored in a single
+ * allocation: the token boundaries are computed first, then every token is
+ * created, with its own header, right after the pointers array. This turns
+ * the N+1 allocations of sdssplitlen() into one, and the tokens are stored
+ * contiguously in memory.
+ *
+ * The result is freed with sdsfreesplitres() as usual, or just with
+ * s_free(), since the tokens are marked as not owned by SDS (see
+ * sdsStackInit()): sdsfree() does nothing on them, and when a token needs
+ * to grow it is moved to a new heap allocation. So the tokens can be
+ * modified, but the ones not moved are no longer valid after the array
+ * is freed: use sdsdup() to keep a token.
+ *
+ * On out of memory, zero length string, zero length separator, NULL is
+ * returned. */
+sds *sdssplitpacked(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
+    int elements = 0, j;
+    long start = 0, end;
+    size_t size, toklen;
+    sds *tokens;
+    char *p, type;
+
+    *count = 0;
+    if (seplen < 1 || len <= 0) return NULL;
+
+    /* Compute the number of tokens and the space they need. */
+    size = 0;
+    do {
+        end = sdsSplitFind(s,len,start,sep,seplen);
+        toklen = (end == -1 ? len : end)-start;
+        type = sdsReqType(toklen);
+        if (type == SDS_TYPE_5) type = SDS_TYPE_8;
+        size += sizeof(sds)+sdsHdrSize(type)+toklen+1;
+        elements++;
+        start = end+seplen;
+    } while(end != -1);
+
+    tokens = s_malloc(size);
+    if (tokens == NULL) return NULL;
+
+    /* Create the tokens after the array. */
+    p = (char*)(tokens+elements);
+    start = 0;
+    for (j = 0; j < elements; j++) {
+        end = sdsSplitFind(s,len,start,sep,seplen);
+        toklen = (end == -1 ? len : end)-start;
+        type = sdsReqType(toklen);
+        if (type == SDS_TYPE_5) type = SDS_TYPE_8;
+        tokens[j] = sdsStaticInit(p,type,toklen);
+        memcpy(tokens[j],s+start,toklen);
+        tokens[j][toklen] = '\0';
+        sdssetlen(tokens[j],toklen);
+        p += sdsHdrSize(type)+toklen+1;
+        start = end+seplen;
     }
+    *count = elements;
+    return tokens;
 }
 
-/* Free the result returned by sdssplitlen(), or do nothing if 'tokens' is NULL. */
-void sdsfreesplitres(sds *tokens, int count) {
-    if (!tokens) return;
-    while(count--)
-        sdsfree(tokens[count]);
+/* Free the result returned by sdssplitview(), or do nothing if 'tokens' is
+ * NULL. The strings the views refer to are not touched. */
+void sdsfreesplitview(sdsview *tokens) {
     s_free(tokens);
 }
 
+/* Return the view 'v' without the characters found in the null terminated
+ * set 'cset' at its left and right, like sdstrim() does for strings. */
+sdsview sdsviewtrim(sdsview v, const char *cset) {
+    sdsByteSet set;
+
+    sdsByteSetInit(&set,cset,strlen(cset)+1);
+    return sdsTrimView(v,&set,1,1);
+}
+
+/* Return the part of the view 'v' from 'start' to 'end', inclusive, with
+ * the same semantics of the indexes of sdsrange(). */
+sdsview sdsviewrange(sdsview v, ssize_t start, ssize_t end) {
+    size_t newlen;
+
+    if (v.len == 0) return v;
+    newlen = sdsRangeNormalize(v.len,&start,end);
+    return sdsviewlen(v.ptr+start,newlen);
+}
+
+/* Compare two views with memcmp(), with the same return value of
+ * sdscmp(). */
+int sdsviewcmp(sdsview v1, sdsview v2) {
+    size_t minlen = (v1.len < v2.len) ? v1.len : v2.len;
+    int cmp = minlen ? memcmp(v1.ptr,v2.ptr,minlen) : 0;
+
+    if (cmp == 0) return v1.len>v2.len? 1: (v1.len<v2.len? -1: 0);
+    return cmp;
+}
+
+/* Compare two views like sdsviewcmp(), but ignoring the case of ASCII
+ * letters, as if both views were turned to lower case by sdstolower(). */
+int sdsviewcasecmp(sdsview v1, sdsview v2) {
+    size_t minlen = (v1.len < v2.len) ? v1.len : v2.len, j = 0;
+    const unsigned char *p1 = (const unsigned char*)v1.ptr;
+    const unsigned char *p2 = (const unsigned char*)v2.ptr;
+
+    /* Skip the words equal once lowered, then look for the first byte
+     * that differs. */
+    for (; j+8 <= minlen; j += 8) {
+        uint64_t w1, w2;
+
+        memcpy(&w1,p1+j,sizeof(w1));
+        memcpy(&w2,p2+j,sizeof(w2));
+        if ((w1 ^ sdsCaseMask(w1,'A','Z')) != (w2 ^ sdsCaseMask(w2,'A','Z')))
+            break;
+    }
+    for (; j < minlen; j++) {
+        int c1 = sdsAsciiLower(p1[j]), c2 = sdsAsciiLower(p2[j]);
+        if (c1 != c2) return c1-c2;
+    }
+    return v1.len>v2.len? 1: (v1.len<v2.len? -1: 0);
+}
+
+/* Compare two sds strings like sdscmp(), but ignoring the case of ASCII
+ * letters. */
+int sdscasecmp(const sds s1, const sds s2) {
+    return sdsviewcasecmp(sdsviewsds(s1),sdsviewsds(s2));
+}
+
+/* Create a new sds string with the content of the view 'v', when the
+ * caller needs to own a copy of it. */
+sds sdsnewview(sdsview v) {
+    return sdsnewlen(v.ptr,v.len);
+}
+
+/* Append the content of the view 'v' to the sds string 's'. */
+sds sdscatview(sds s, sdsview v) {
+    return sdscatlen(s,v.ptr,v.len);
+}
+
+/* Return non zero if any byte of the word 'w' is equal to 'c'. The bytes
+ * equal to 'c' are zero after the xor, and subtracting one from a zero byte
+ * is the only way to set its high bit starting from a byte without it. */
+static inline int sdsSwarHasByte(uint64_t w, unsigned char c) {
+    w ^= SDS_SWAR_ONES*c;
+    return ((w - SDS_SWAR_ONES) & ~w & (SDS_SWAR_ONES*0x80)) != 0;
+}
+
+/* The representation of every byte in the output of sdscatrepr(): the
+ * printable ASCII characters stand for themselves, except for the backslash
+ * and the double quote, that are escaped like the common control characters,
+ * and all the other bytes are in the "\x<hex-number>" form. The entries are
+ * padded to four bytes, so that they are always copied at once. */
+static const char sdsReprTable[256][4] = {
+    "\\x00","\\x01","\\x02","\\x03","\\x04","\\x05","\\x06","\\a",
+    "\\b","\\t","\\n","\\x0b","\\x0c","\\r","\\x0e","\\x0f",
+    "\\x10","\\x11","\\x12","\\x13","\\x14","\\x15","\\x16","\\x17",
+    "\\x18","\\x19","\\x1a","\\x1b","\\x1c","\\x1d","\\x1e","\\x1f",
+    " ","!","\\\"","#","$","%","&","'",
+    "(",")","*","+",",","-",".","/",
+    "0","1","2","3","4","5","6","7",
+    "8","9",":",";","<","=",">","?",
+    "@","A","B","C","D","E","F","G",
+    "H","I","J","K","L","M","N","O",
+    "P","Q","R","S","T","U","V","W",
+    "X","Y","Z","[","\\\\","]","^","_",
+    "`","a","b","c","d","e","f","g",
+    "h","i","j","k","l","m","n","o",
+    "p","q","r","s","t","u","v","w",
+    "x","y","z","{","|","}","~","\\x7f",
+    "\\x80","\\x81","\\x82","\\x83","\\x84","\\x85","\\x86","\\x87",
+    "\\x88","\\x89","\\x8a","\\x8b","\\x8c","\\x8d","\\x8e","\\x8f",
+    "\\x90","\\x91","\\x92","\\x93","\\x94","\\x95","\\x96","\\x97",
+    "\\x98","\\x99","\\x9a","\\x9b","\\x9c","\\x9d","\\x9e","\\x9f",
+    "\\xa0","\\xa1","\\xa2","\\xa3","\\xa4","\\xa5","\\xa6","\\xa7",
+    "\\xa8","\\xa9","\\xaa","\\xab","\\xac","\\xad","\\xae","\\xaf",
+    "\\xb0","\\xb1","\\xb2","\\xb3","\\xb4","\\xb5","\\xb6","\\xb7",
+    "\\xb8","\\xb9","\\xba","\\xbb","\\xbc","\\xbd","\\xbe","\\xbf",
+    "\\xc0","\\xc1","\\xc2","\\xc3","\\xc4","\\xc5","\\xc6","\\xc7",
+    "\\xc8","\\xc9","\\xca","\\xcb","\\xcc","\\xcd","\\xce","\\xcf",
+    "\\xd0","\\xd1","\\xd2","\\xd3","\\xd4","\\xd5","\\xd6","\\xd7",
+    "\\xd8","\\xd9","\\xda","\\xdb","\\xdc","\\xdd","\\xde","\\xdf",
+    "\\xe0","\\xe1","\\xe2","\\xe3","\\xe4","\\xe5","\\xe6","\\xe7",
+    "\\xe8","\\xe9","\\xea","\\xeb","\\xec","\\xed","\\xee","\\xef",
+    "\\xf0","\\xf1","\\xf2","\\xf3","\\xf4","\\xf5","\\xf6","\\xf7",
+    "\\xf8","\\xf9","\\xfa","\\xfb","\\xfc","\\xfd","\\xfe","\\xff"
+};
+
+/* Return the length of the representation 'e' of a byte in the table above,
+ * counting the bytes before the padding. The result is computed without
+ * branches, that are hardly predictable when the input is binary data. */
+static inline size_t sdsReprLen(const char *e) {
+    return 1 + (e[1] != '\0') + 2*(e[2] != '\0');
+}
+
+/* Return non zero if none of the eight bytes at 'p' is a backslash or a
+ * double quote, so that sdsunrepr() copies them verbatim. */
+static inline int sdsUnreprPlainWord(const char *p) {
+    uint64_t w;
+
+    memcpy(&w,p,sizeof(w));
+    return !sdsSwarHasByte(w,'"') && !sdsSwarHasByte(w,'\\');
+}
+
+/* Return non zero if the eight bytes at 'p' are copied verbatim by
+ * sdscatrepr(), that is, if they are printable ASCII and none of them is a
+ * backslash or a double quote. */
+static inline int sdsReprPlainWord(const char *p) {
+    uint64_t w;
+
+    memcpy(&w,p,sizeof(w));
+    return sdsCaseMask(w,0x20,0x7e) == SDS_SWAR_ONES*0x20 &&
+           sdsUnreprPlainWord(p);
+}
+
+/* Return the length of the run of bytes at the start of 'p' that are
+ * copied verbatim by sdscatrepr(), checking eight bytes at a time. */
+static size_t sdsReprRun(const char *p, size_t len) {
+    size_t j = 0;
+
+    while(j+8 <= len && sdsReprPlainWord(p+j)) j += 8;
+    while(j < len && sdsReprLen(sdsReprTable[(unsigned char)p[j]]) == 1) j++;
+    return j;
+}
+
 /* Append to the sds string "s" an escaped string representation where
- * all the non-printable characters (tested with isprint()) are turned into
- * escapes in the form "\n\r\a...." or "\x<hex-number>".
+ * all the non-printable characters are turned into escapes in the form
+ * "\n\r\a...." or "\x<hex-number>". Only the printable ASCII characters are
+ * copied verbatim, whatever the locale is.
+ *
+ * Runs of printable characters are located eight bytes at a time and copied
+ * at once, while the bytes around the escapes are translated using a table,
+ * with the room for their representation reserved in advance, so that even
+ * binary data is not appended one byte at a time.
  *
  * After the call, the modified sds string is no longer valid and all the
  * references must be substituted with the new pointer returned by the call. */
 sds sdscatrepr(sds s, const char *p, size_t len) {
+    s = sdsMakeRoomFor(s,len+2);
+    if (s == NULL) return NULL;
     s = sdscatlen(s,"\"",1);
-    while(len--) {
-        switch(*p) {
-        case '\\':
-        case '"':
-            s = sdscatprintf(s,"\\%c",*p);
-            break;
-        case '\n': s = sdscatlen(s,"\\n",2); break;
-        case '\r': s = sdscatlen(s,"\\r",2); break;
-        case '\t': s = sdscatlen(s,"\\t",2); break;
-        case '\a': s = sdscatlen(s,"\\a",2); break;
-        case '\b': s = sdscatlen(s,"\\b",2); break;
-        default:
-            if (isprint(*p))
-                s = sdscatprintf(s,"%c",*p);
-            else
-                s = sdscatprintf(s,"\\x%02x",(unsigned char)*p);
-            break;
+    while(len) {
+        size_t run = sdsReprRun(p,len), esc = run, j;
+        char *t;
+
+        /* Translate the bytes after the run with the table, sixteen at a
+         * time, until a whole word of printable characters follows, or
+         * the room reserved for them would be too large. */
+        while(esc < len && esc-run < 256) {
+            esc = esc+16 < len ? esc+16 : len;
+            if (esc+8 <= len && sdsReprPlainWord(p+esc)) break;
         }
-        p++;
+        s = sdsMakeRoomFor(s,run+(esc-run)*4+1);
+        if (s == NULL) return NULL;
+        t = s+sdslen(s);
+        memcpy(t,p,run);
+        t += run;
+        for (j = run; j < esc; j++) {
+            const char *e = sdsReprTable[(unsigned char)p[j]];
+
+            memcpy(t,e,4);
+            t += sdsReprLen(e);
+        }
+        sdsIncrLen(s,t-(s+sdslen(s)));
+        p += esc;
+        len -= esc;
     }
     return sdscatlen(s,"\"",1);
 }
@@ -951,6 +2229,125 @@ int hex_digit_to_int(char c) {
     }
 }
 
+/* The value plus one of the hex digits, and zero for the other bytes. */
+static const unsigned char sdsHexTable[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+/* Decode the two hex digits at 'p' into the byte '*c', returning zero if
+ * they are not both hex digits. Comparing the digits with the ranges of
+ * valid characters turns out to be much slower on binary data, where the
+ * digits are random. */
+static inline int sdsDecodeHex(const char *p, char *c) {
+    int hi, lo;
+
+    /* The second digit is not accessed if the first is the terminator. */
+    if ((hi = sdsHexTable[(unsigned char)p[0]]) == 0) return 0;
+    if ((lo = sdsHexTable[(unsigned char)p[1]]) == 0) return 0;
+    *c = ((hi-1) << 4) | (lo-1);
+    return 1;
+}
+
+/* Decode the escape sequence starting with the backslash at 'p', as found
+ * inside the double quoted strings of sdssplitargs(), storing the resulting
+ * byte in '*c'. Returns the number of bytes of the sequence, or zero if the
+ * backslash is the last byte of the input. */
+static int sdsDecodeEscape(const char *p, char *c) {
+    if (*(p+1) == 'x' && sdsDecodeHex(p+2,c)) return 4;
+    switch(*(p+1)) {
+    case '\0': return 0;
+    case 'n': *c = '\n'; break;
+    case 'r': *c = '\r'; break;
+    case 't': *c = '\t'; break;
+    case 'b': *c = '\b'; break;
+    case 'a': *c = '\a'; break;
+    default: *c = *(p+1); break;
+    }
+    return 2;
+}
+
+/* Decode the double quoted string representation 'p' of 'len' bytes, in
+ * the form produced by sdscatrepr(), returning a new sds string. Escape
+ * sequences are decoded like the double quoted arguments of sdssplitargs():
+ * the string is binary safe but all its bytes, except for the escapes and
+ * the quotes, are copied verbatim.
+ *
+ * NULL is returned on out of memory, or if the input is not a valid quoted
+ * string: the first byte must be a double quote, and the only unescaped
+ * double quote that follows must be the last byte.
+ *
+ * Example:
+ *
+ * s = sdsunrepr("\"a\\x00b\\n\"",10); => "a\0b\n", 4 bytes long. */
+sds sdsunrepr(const char *p, size_t len) {
+    const char *end = p+len;
+    char *t;
+    sds s;
+
+    if (len < 2 || *p != '"') return NULL;
+    p++;
+
+    /* The decoded string is never longer than the quoted one. */
+    s = sdsnewcap(len-2);
+    if (s == NULL) return NULL;
+    t = s;
+    while(p < end) {
+        int j;
+
+        /* Copy the bytes eight at a time up to the next backslash or quote,
+         * then process them one by one, until a whole word without special
+         * bytes follows. */
+        while(end-p >= 8 && sdsUnreprPlainWord(p)) {
+            memcpy(t,p,8);
+            t += 8;
+            p += 8;
+        }
+        for (j = 0; j < 16 && p < end; j++) {
+            char seq[4] = {0};
+            int esclen;
+
+            if (*p == '"') goto closed;
+            if (*p != '\\') {
+                *t++ = *p++;
+                continue;
+            }
+            /* Hex escapes, the most common ones in binary data, are
+             * decoded inline. */
+            if (end-p >= 4 && p[1] == 'x' && sdsDecodeHex(p+2,t)) {
+                t++;
+                p += 4;
+                continue;
+            }
+            /* Near the end of the input the escape sequence may be
+             * truncated, so it is decoded from a null terminated copy. */
+            if (end-p >= 4) {
+                esclen = sdsDecodeEscape(p,t);
+            } else {
+                memcpy(seq,p,end-p);
+                esclen = sdsDecodeEscape(seq,t);
+            }
+            if (esclen == 0) goto err;
+            t++;
+            p += esclen;
+        }
+    }
+    goto err; /* Unterminated quotes. */
+
+closed:
+    /* The closing quote must be the last byte. */
+    if (p+1 != end) goto err;
+    sdssetlen(s,t-s);
+    *t = '\0';
+    return s;
+
+err:
+    sdsfree(s);
+    return NULL;
+}
+
 /* Split a line into arguments, where every argument can be in the
  * following programming-language REPL-alike form:
  *
@@ -972,103 +2369,82 @@ int hex_digit_to_int(char c) {
  */
 sds *sdssplitargs(const char *line, int *argc) {
     const char *p = line;
-    char *current = NULL;
-    char **vector = NULL;
+    sds current = NULL;
+    sds *vector = NULL;
+    int slots = 0;
+    size_t run;
+    char c;
 
     *argc = 0;
     while(1) {
         /* skip blanks */
         while(*p && isspace(*p)) p++;
-        if (*p) {
-            /* get a token */
-            int inq=0;  /* set to 1 if we are in "quotes" */
-            int insq=0; /* set to 1 if we are in 'single quotes' */
-            int done=0;
-
-            if (current == NULL) current = sdsempty();
-            while(!done) {
-                if (inq) {
-                    if (*p == '\\' && *(p+1) == 'x' &&
-                                             is_hex_digit(*(p+2)) &&
-                                             is_hex_digit(*(p+3)))
-                    {
-                        unsigned char byte;
-
-                        byte = (hex_digit_to_int(*(p+2))*16)+
-                                hex_digit_to_int(*(p+3));
-                        current = sdscatlen(current,(char*)&byte,1);
-                        p += 3;
-                    } else if (*p == '\\' && *(p+1)) {
-                        char c;
-
-                        p++;
-                        switch(*p) {
-                        case 'n': c = '\n'; break;
-                        case 'r': c = '\r'; break;
-                        case 't': c = '\t'; break;
-                        case 'b': c = '\b'; break;
-                        case 'a': c = '\a'; break;
-                        default: c = *p; break;
-                        }
-                        current = sdscatlen(current,&c,1);
-                    } else if (*p == '"') {
-                        /* closing quote must be followed by a space or
-                         * nothing at all. */
-                        if (*(p+1) && !isspace(*(p+1))) goto err;
-                        done=1;
-                    } else if (!*p) {
-                        /* unterminated quotes */
-                        goto err;
-                    } else {
-                        current = sdscatlen(current,p,1);
-                    }
-                } else if (insq) {
-                    if (*p == '\\' && *(p+1) == '\'') {
-                        p++;
-                        current = sdscatlen(current,"'",1);
-                    } else if (*p == '\'') {
-                        /* closing quote must be followed by a space or
-                         * nothing at all. */
-                        if (*(p+1) && !isspace(*(p+1))) goto err;
-                        done=1;
-                    } else if (!*p) {
-                        /* unterminated quotes */
-                        goto err;
-                    } else {
-                        current = sdscatlen(current,p,1);
-                    }
-                } else {
-                    switch(*p) {
-                    case ' ':
-                    case '\n':
-                    case '\r':
-                    case '\t':
-                    case '\0':
-                        done=1;
-                        break;
-                    case '"':
-                        inq=1;
-                        break;
-                    case '\'':
-                        insq=1;
-                        break;
-                    default:
-                        current = sdscatlen(current,p,1);
-                        break;
-                    }
-                }
-                if (*p) p++;
-            }
-            /* add the token to the vector */
-            vector = s_realloc(vector,((*argc)+1)*sizeof(char*));
-            vector[*argc] = current;
-            (*argc)++;
-            current = NULL;
-        } else {
+        if (!*p) {
             /* Even on empty input string return something not NULL. */
             if (vector == NULL) vector = s_malloc(sizeof(void*));
             return vector;
         }
+
+        /* Get a token. Runs of bytes without a special meaning are searched
+         * with strcspn() and appended at once: the unquoted prefix of the
+         * token, that is usually the whole token, creates the string with
+         * the exact size. */
+        run = strcspn(p," \n\r\t\"'");
+        current = sdsnewlen(p,run);
+        if (current == NULL) goto err;
+        p += run;
+        if (*p == '"') {
+            while(1) {
+                p++;
+                run = strcspn(p,"\"\\");
+                current = sdscatlen(current,p,run);
+                if (current == NULL) goto err;
+                p += run;
+                if (*p == '"') break;
+                /* unterminated quotes */
+                if (*p == '\0' || (run = sdsDecodeEscape(p,&c)) == 0) goto err;
+                current = sdscatlen(current,&c,1);
+                if (current == NULL) goto err;
+                p += run-1;
+            }
+        } else if (*p == '\'') {
+            while(1) {
+                p++;
+                run = strcspn(p,"'\\");
+                current = sdscatlen(current,p,run);
+                if (current == NULL) goto err;
+                p += run;
+                if (*p == '\'') break;
+                /* unterminated quotes */
+                if (*p == '\0') goto err;
+                if (*(p+1) == '\'') {
+                    p++;
+                    current = sdscatlen(current,"'",1);
+                } else {
+                    current = sdscatlen(current,"\\",1);
+                }
+                if (current == NULL) goto err;
+            }
+        }
+        if (*p == '"' || *p == '\'') {
+            /* closing quote must be followed by a space or
+             * nothing at all. */
+            if (*(p+1) && !isspace(*(p+1))) goto err;
+            p++;
+        }
+
+        /* add the token to the vector */
+        if (*argc == slots) {
+            sds *newvector;
+
+            slots = slots ? slots*2 : 4;
+            newvector = s_realloc(vector,slots*sizeof(sds));
+            if (newvector == NULL) goto err;
+            vector = newvector;
+        }
+        vector[*argc] = current;
+        (*argc)++;
+        current = NULL;
     }
 
 err:
@@ -1080,27 +2456,58 @@ err:
     return NULL;
 }
 
-/* Modify the string substituting all the occurrences of the set of
- * characters specified in the 'from' string to the corresponding character
- * in the 'to' array.
+/* Initialize the character map 'cm', so that sdsCharMapApply() substitutes
+ * every character of the 'from' set with the character at the same index
+ * of 'to', both sets being 'setlen' bytes long. If a character appears
+ * more than once in 'from', the first occurrence is used.
+ *
+ * The map is a 256 bytes translation table: applying it costs a lookup per
+ * byte of the string whatever the size of the set, and it can be reused by
+ * any number of calls. */
+void sdsCharMapInit(sdsCharMap *cm, const char *from, const char *to, size_t setlen) {
+    int j;
+
+    for (j = 0; j < 256; j++) cm->map[j] = j;
+    /* Scan backward so that the first occurrence wins. */
+    while(setlen--) cm->map[(unsigned char)from[setlen]] = to[setlen];
+}
+
+/* Substitute the characters of 's' according to the character map 'cm'.
+ * The function returns the sds string pointer, that is always the same
+ * as the input pointer since no resize is needed, unless 's' is a shared
+ * string referenced by others, that is copied before being modified. */
+sds sdsCharMapApply(const sdsCharMap *cm, sds s) {
+    size_t j, l = sdslen(s);
+    unsigned char *p;
+
+    if (sdsIsShared(s)) {
+        s = sdsCopyOnWrite(s, s, l, l);
+        if (s == NULL) return NULL;
+    }
+
+    p = (unsigned char*)s;
+    for (j = 0; j < l; j++) p[j] = cm->map[p[j]];
+    return s;
+}
+
+/* Modify the string substituting all the occurrences of the set of
+ * characters specified in the 'from' string to the corresponding character
+ * in the 'to' array.
  *
  * For instance: sdsmapchars(mystring, "ho", "01", 2)
  * will have the effect of turning the string "hello" into "0ell1".
  *
  * The function returns the sds string pointer, that is always the same
- * as the input pointer since no resize is needed. */
+ * as the input pointer since no resize is needed, unless 's' is a shared
+ * string referenced by others, that is copied before being modified.
+ *
+ * When the same substitution is applied to many strings, it is faster to
+ * build the character map once, see sdsCharMapInit(). */
 sds sdsmapchars(sds s, const char *from, const char *to, size_t setlen) {
-    size_t j, i, l = sdslen(s);
+    sdsCharMap cm;
 
-    for (j = 0; j < l; j++) {
-        for (i = 0; i < setlen; i++) {
-            if (s[j] == from[i]) {
-                s[j] = to[i];
-                break;
-            }
-        }
-    }
-    return s;
+    sdsCharMapInit(&cm,from,to,setlen);
+    return sdsCharMapApply(&cm,s);
 }
 
 /* Join an array of C strings using the specified separator (also a C string).
@@ -1128,6 +2535,1580 @@ sds sdsjoinsds(sds *argv, int argc, const char *sep, size_t seplen) {
     return join;
 }
 
+/* ------------------------------ Arguments parser -----------------------------
+ *
+ * The arguments parser splits lines into arguments exactly like
+ * sdssplitargs() does, but the input can be fed in chunks of any size, as
+ * read from the network: a line is terminated by a newline, and the state
+ * of the parser (including quotes and escape sequences) is retained between
+ * calls, so every byte is scanned just once. Completed lines are queued and
+ * returned by sdsArgsParserNext().
+ *
+ * As with sdssplitargs(), that stops at the null term, the part of a line
+ * after a null byte is ignored. */
+
+#define SDS_ARGS_BLANK 0    /* Between arguments. */
+#define SDS_ARGS_TOKEN 1    /* Inside an unquoted argument. */
+#define SDS_ARGS_DQ 2       /* Inside "double quotes". */
+#define SDS_ARGS_DQ_ESC 3   /* After a backslash inside double quotes. */
+#define SDS_ARGS_SQ 4       /* Inside 'single quotes'. */
+#define SDS_ARGS_SQ_ESC 5   /* After a backslash inside single quotes. */
+#define SDS_ARGS_CLOSED 6   /* After a closing quote. */
+#define SDS_ARGS_SKIP 7     /* After a null byte: skip the rest of the line. */
+#define SDS_ARGS_ERR 8      /* Syntax error: skip the rest of the line. */
+
+/* Bytes terminating the runs copied at once in the token and quoted states,
+ * as bit masks indexed by byte value. */
+#define SDS_ARGS_STOP_TOKEN (1<<0)
+#define SDS_ARGS_STOP_DQ (1<<1)
+#define SDS_ARGS_STOP_SQ (1<<2)
+static const unsigned char sdsArgsStop[256] = {
+    ['\0'] = 7, ['\n'] = 7, [' '] = 1, ['\r'] = 1, ['\t'] = 1,
+    ['"'] = 3, ['\''] = 5, ['\\'] = 6
+};
+
+typedef struct sdsArgsLine {
+    struct sdsArgsLine *next;
+    sds *argv;      /* NULL if the line has a syntax error. */
+    int argc;
+} sdsArgsLine;
+
+struct sdsArgsParser {
+    int state;
+    int pending;        /* True if the current line is not empty. */
+    sds current;        /* Argument being parsed, or NULL. */
+    sds *vector;        /* Arguments of the current line. */
+    int argc, slots;
+    char esc[2];        /* Escape sequence bytes after the backslash. */
+    int esclen;
+    sdsArgsLine *head, *tail; /* Completed lines. */
+};
+
+/* Create a new arguments parser. Returns NULL on out of memory. */
+sdsArgsParser *sdsArgsParserCreate(void) {
+    sdsArgsParser *ap = s_malloc(sizeof(*ap));
+
+    if (ap == NULL) return NULL;
+    memset(ap,0,sizeof(*ap));
+    return ap;
+}
+
+/* Free the arguments of the current line. */
+static void sdsArgsReset(sdsArgsParser *ap) {
+    sdsfreesplitres(ap->vector,ap->argc);
+    sdsfree(ap->current);
+    ap->vector = NULL;
+    ap->current = NULL;
+    ap->argc = ap->slots = 0;
+}
+
+/* Append 'len' bytes at 'p' to the current argument, creating it if
+ * needed. Returns 0 on success, or -1 on out of memory, in which case the
+ * current argument is left untouched. */
+static int sdsArgsCat(sdsArgsParser *ap, const char *p, size_t len) {
+    sds s = ap->current ? sdscatlen(ap->current,p,len) : sdsnewlen(p,len);
+
+    if (s == NULL) return -1;
+    ap->current = s;
+    return 0;
+}
+
+/* Add the current argument to the vector of the current line. Returns 0
+ * on success, or -1 on out of memory. */
+static int sdsArgsTokenDone(sdsArgsParser *ap) {
+    if (ap->argc == ap->slots) {
+        int slots = ap->slots ? ap->slots*2 : 4;
+        sds *vector = s_realloc(ap->vector,slots*sizeof(sds));
+
+        if (vector == NULL) return -1;
+        ap->vector = vector;
+        ap->slots = slots;
+    }
+    ap->vector[ap->argc++] = ap->current;
+    ap->current = NULL;
+    return 0;
+}
+
+/* Queue the current line, or an error if 'err' is true, and start a new
+ * one. Returns 0 on success, or -1 on out of memory, in which case the
+ * line is discarded without being queued. */
+static int sdsArgsLineDone(sdsArgsParser *ap, int err) {
+    sdsArgsLine *line = s_malloc(sizeof(*line));
+
+    ap->state = SDS_ARGS_BLANK;
+    ap->pending = 0;
+    /* Even for empty lines return something not NULL. */
+    if (!err && ap->vector == NULL && line != NULL) {
+        ap->vector = s_malloc(sizeof(void*));
+        if (ap->vector == NULL) {
+            s_free(line);
+            line = NULL;
+        }
+    }
+    if (err || line == NULL) {
+        sdsArgsReset(ap);
+        if (line == NULL) return -1;
+        line->argv = NULL;
+        line->argc = 0;
+    } else {
+        line->argv = ap->vector;
+        line->argc = ap->argc;
+        ap->vector = NULL;
+        ap->argc = ap->slots = 0;
+    }
+    line->next = NULL;
+    if (ap->tail)
+        ap->tail->next = line;
+    else
+        ap->head = line;
+    ap->tail = line;
+    return 0;
+}
+
+/* Return the length of the run of bytes without special meaning in the
+ * state having the stop mask 'stop', starting at 'p'. */
+static size_t sdsArgsRun(const char *p, const char *end, unsigned char stop) {
+    const char *q = p;
+
+    while(q < end && !(sdsArgsStop[(unsigned char)*q] & stop)) q++;
+    return q-p;
+}
+
+/* Parse the 'len' bytes at 'buf'. The lines completed by this chunk are
+ * returned by sdsArgsParserNext().
+ *
+ * Returns 0 on success, or -1 on out of memory. In the latter case the
+ * line being parsed is reported by sdsArgsParserNext() as if it had a
+ * syntax error, or is discarded if even that is not possible, and the
+ * rest of the input is parsed as usual: the parser can still be fed and
+ * freed. */
+int sdsArgsParserFeed(sdsArgsParser *ap, const char *buf, size_t len) {
+    const char *p = buf, *end = buf+len;
+    int retval = 0;
+    size_t run;
+    char c;
+
+    while(p < end) {
+        c = *p;
+        if (c != '\n') ap->pending = 1;
+        switch(ap->state) {
+        case SDS_ARGS_BLANK:
+            if (c == '\n') {
+                if (sdsArgsLineDone(ap,0) == -1) retval = -1;
+                p++;
+            } else if (c == '\0') {
+                ap->state = SDS_ARGS_SKIP;
+                p++;
+            } else if (isspace(c)) {
+                p++;
+            } else {
+                ap->state = SDS_ARGS_TOKEN;
+            }
+            break;
+        case SDS_ARGS_TOKEN:
+            run = sdsArgsRun(p,end,SDS_ARGS_STOP_TOKEN);
+            if (sdsArgsCat(ap,p,run) == -1) goto oom;
+            p += run;
+            if (p == end) break;
+            if (*p == '"') {
+                ap->state = SDS_ARGS_DQ;
+                p++;
+            } else if (*p == '\'') {
+                ap->state = SDS_ARGS_SQ;
+                p++;
+            } else {
+                /* Blank, newline or null byte: handled by the next state. */
+                if (sdsArgsTokenDone(ap) == -1) goto oom;
+                ap->state = SDS_ARGS_BLANK;
+            }
+            break;
+        case SDS_ARGS_DQ:
+        case SDS_ARGS_SQ:
+            run = sdsArgsRun(p,end,ap->state == SDS_ARGS_DQ ?
+                                   SDS_ARGS_STOP_DQ : SDS_ARGS_STOP_SQ);
+            if (sdsArgsCat(ap,p,run) == -1) goto oom;
+            p += run;
+            if (p == end) break;
+            if (*p == '\\') {
+                ap->state++; /* SDS_ARGS_DQ_ESC or SDS_ARGS_SQ_ESC. */
+                ap->esclen = 0;
+                p++;
+            } else if (*p == '"' || *p == '\'') {
+                ap->state = SDS_ARGS_CLOSED;
+                p++;
+            } else {
+                /* unterminated quotes */
+                ap->state = SDS_ARGS_ERR;
+            }
+            break;
+        case SDS_ARGS_DQ_ESC:
+            if (ap->esclen == 0 && c != 'x') {
+                char seq[3] = {'\\', c, '\0'};
+
+                /* A backslash at the end of the line is an error. */
+                if (c == '\n' || sdsDecodeEscape(seq,&c) == 0) {
+                    ap->state = SDS_ARGS_ERR;
+                    break;
+                }
+                if (sdsArgsCat(ap,&c,1) == -1) goto oom;
+                ap->state = SDS_ARGS_DQ;
+                p++;
+            } else if (ap->esclen < 2 && (ap->esclen == 0 || is_hex_digit(c))) {
+                ap->esc[ap->esclen++] = c;
+                p++;
+            } else if (ap->esclen == 2 && is_hex_digit(c)) {
+                c = (hex_digit_to_int(ap->esc[1])*16)+hex_digit_to_int(c);
+                if (sdsArgsCat(ap,&c,1) == -1) goto oom;
+                ap->state = SDS_ARGS_DQ;
+                p++;
+            } else {
+                /* Not a \xHH sequence: the backslash just escapes the 'x',
+                 * and the following bytes are normal quoted bytes. */
+                if (sdsArgsCat(ap,ap->esc,ap->esclen) == -1) goto oom;
+                ap->state = SDS_ARGS_DQ;
+            }
+            break;
+        case SDS_ARGS_SQ_ESC:
+            if (c == '\'') {
+                if (sdsArgsCat(ap,"'",1) == -1) goto oom;
+                p++;
+            } else {
+                if (sdsArgsCat(ap,"\\",1) == -1) goto oom;
+            }
+            ap->state = SDS_ARGS_SQ;
+            break;
+        case SDS_ARGS_CLOSED:
+            /* closing quote must be followed by a space or
+             * nothing at all. */
+            if (c != '\0' && !isspace(c)) {
+                ap->state = SDS_ARGS_ERR;
+                break;
+            }
+            if (sdsArgsTokenDone(ap) == -1) goto oom;
+            ap->state = SDS_ARGS_BLANK;
+            break;
+        case SDS_ARGS_SKIP:
+        case SDS_ARGS_ERR:
+            p = memchr(p,'\n',end-p);
+            if (p == NULL) return retval;
+            if (sdsArgsLineDone(ap,ap->state == SDS_ARGS_ERR) == -1)
+                retval = -1;
+            p++;
+            break;
+        }
+        continue;
+
+oom:
+        /* Discard the line, skipping the rest of it as on syntax errors. */
+        sdsArgsReset(ap);
+        ap->state = SDS_ARGS_ERR;
+        retval = -1;
+    }
+    return retval;
+}
+
+/* Terminate the input: if the last line is not terminated by a newline it
+ * is completed as if it was. Returns 0 on success, or -1 on out of memory,
+ * like sdsArgsParserFeed(). */
+int sdsArgsParserFinish(sdsArgsParser *ap) {
+    /* The end of the input is handled as sdssplitargs() handles the end
+     * of the string. */
+    if (ap->pending) return sdsArgsParserFeed(ap,"\0\n",2);
+    return 0;
+}
+
+/* Return the next completed line, if any. On success 1 is returned, and
+ * '*argv' and '*argc' are set as sdssplitargs() would return them: the
+ * caller owns the arguments, and frees them with sdsfreesplitres(). If the
+ * line has a syntax error, like unbalanced quotes, -1 is returned. If no
+ * complete line is available yet 0 is returned. In both cases '*argv' is
+ * set to NULL. */
+int sdsArgsParserNext(sdsArgsParser *ap, sds **argv, int *argc) {
+    sdsArgsLine *line = ap->head;
+    int retval;
+
+    *argv = NULL;
+    *argc = 0;
+    if (line == NULL) return 0;
+    ap->head = line->next;
+    if (ap->head == NULL) ap->tail = NULL;
+    *argv = line->argv;
+    *argc = line->argc;
+    retval = line->argv ? 1 : -1;
+    s_free(line);
+    return retval;
+}
+
+/* Free the parser, including the lines not yet returned. */
+void sdsArgsParserFree(sdsArgsParser *ap) {
+    sdsArgsLine *line, *next;
+
+    if (ap == NULL) return;
+    for (line = ap->head; line; line = next) {
+        next = line->next;
+        sdsfreesplitres(line->argv,line->argc);
+        s_free(line);
+    }
+    sdsArgsReset(ap);
+    s_free(ap);
+}
+
+/* ---------------------------- File descriptors I/O ---------------------------
+ *
+ * Helpers reading into the free space of a string, and writing strings,
+ * without intermediate buffers. They are only available on systems having
+ * read() and writev(): elsewhere they fail with errno set to ENOSYS. */
+
+#define SDS_IOV_MAX 64 /* Max strings written by a single writev() call. */
+
+/* Read from 'fd' directly into the free space at the end of the string
+ * pointed by 's', that is enlarged as needed and updated with the new
+ * pointer. The return value is the one of read(): the number of bytes
+ * appended to the string, 0 on end of file, or -1 on error (ENOMEM if the
+ * string could not be enlarged), with interrupted reads being retried.
+ *
+ * 'hint' points to the number of bytes to read, or to zero to start with
+ * SDS_READ_LEN bytes. The function adapts it to the traffic for the next
+ * call: it is doubled (up to SDS_READ_MAX_LEN) when a read fills the whole
+ * buffer, and halved (down to SDS_READ_MIN_LEN) when less than half of it
+ * is used. A NULL 'hint' always reads SDS_READ_LEN bytes.
+ *
+ * size_t readlen = 0;
+ * while((nread = sdsReadFromFd(&c->querybuf,fd,&readlen)) > 0)
+ *     processInput(c);
+ */
+ssize_t sdsReadFromFd(sds *s, int fd, size_t *hint) {
+#ifdef SDS_HAVE_FDIO
+    size_t readlen = (hint && *hint) ? *hint : SDS_READ_LEN;
+    ssize_t nread;
+    sds news = sdsMakeRoomFor(*s,readlen);
+
+    if (news == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *s = news;
+    do {
+        nread = read(fd,news+sdslen(news),readlen);
+    } while(nread == -1 && errno == EINTR);
+    if (nread <= 0) return nread;
+    sdsIncrLen(news,nread);
+
+    if (hint) {
+        if ((size_t)nread == readlen && readlen < SDS_READ_MAX_LEN)
+            readlen = readlen*2 < SDS_READ_MAX_LEN ? readlen*2 : SDS_READ_MAX_LEN;
+        else if ((size_t)nread < readlen/2 && readlen > SDS_READ_MIN_LEN)
+            readlen = readlen/2 > SDS_READ_MIN_LEN ? readlen/2 : SDS_READ_MIN_LEN;
+        *hint = readlen;
+    }
+    return nread;
+#else
+    UNUSED(s);
+    UNUSED(fd);
+    UNUSED(hint);
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Write the 'count' strings of 'array' to 'fd' as a single stream, using
+ * a writev() call for every SDS_IOV_MAX strings. '*progress' is the number
+ * of bytes of the stream already written by previous calls, that is
+ * skipped, and it is incremented by the number of bytes written.
+ *
+ * Writing continues until the whole stream is written, or the kernel
+ * accepts less bytes than requested, as it happens with non blocking
+ * sockets, so that the caller can call the function again, with the same
+ * array and progress, once the descriptor is writable.
+ *
+ * Returns the number of bytes written by this call. If an error occurs
+ * before anything is written -1 is returned, and errno is set: EAGAIN
+ * means that the descriptor is not writable at the moment. */
+ssize_t sdsWritevArray(int fd, const sds *array, size_t count, size_t *progress) {
+#ifdef SDS_HAVE_FDIO
+    struct iovec iov[SDS_IOV_MAX];
+    size_t total = 0, skip = *progress, j = 0;
+
+    /* Skip the strings already written. */
+    while(j < count && skip >= sdslen(array[j])) skip -= sdslen(array[j++]);
+
+    while(j < count) {
+        size_t wanted = 0, next = j, offset = skip;
+        ssize_t nwritten;
+        int iovcnt = 0;
+
+        while(next < count && iovcnt < SDS_IOV_MAX) {
+            size_t len = sdslen(array[next])-offset;
+            if (len) {
+                iov[iovcnt].iov_base = array[next]+offset;
+                iov[iovcnt].iov_len = len;
+                wanted += len;
+                iovcnt++;
+            }
+            offset = 0;
+            next++;
+        }
+        if (iovcnt == 0) break; /* Only empty strings left. */
+
+        nwritten = writev(fd,iov,iovcnt);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            return total ? (ssize_t)total : -1;
+        }
+        total += nwritten;
+        *progress += nwritten;
+        if ((size_t)nwritten < wanted) break;
+        j = next;
+        skip = 0;
+    }
+    return total;
+#else
+    UNUSED(fd);
+    UNUSED(array);
+    UNUSED(count);
+    UNUSED(progress);
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Write the string 's' to 'fd', starting at the offset '*progress', that
+ * is incremented by the number of bytes written. The return value and the
+ * handling of partial writes are the same of sdsWritevArray(). */
+ssize_t sdsWriteToFd(const sds s, int fd, size_t *progress) {
+    return sdsWritevArray(fd,&s,1,progress);
+}
+
+/* -------------------------------- Line reader --------------------------------
+ *
+ * The line reader reads a file descriptor in big blocks into a buffer, and
+ * returns the lines found in the buffer one after the other, as views into
+ * the buffer or copied into a string reused across calls, so that there is
+ * no allocation per line. Lines are found with memchr(), that the libc
+ * implements with vector instructions, and a line spanning many blocks is
+ * never scanned twice.
+ *
+ * Returned lines are consumed from the buffer with sdsconsume(), so they are
+ * not moved until the next read needs the space. */
+
+struct sdsLineReader {
+    int fd;
+    int owned;          /* True if the reader must close the fd. */
+    int eof;
+    size_t blocksize;
+    sds buf;            /* Read data, starting with the last line returned. */
+    size_t used;        /* Length of the last line returned, to consume. */
+    size_t scanned;     /* Bytes after it known not to contain newlines. */
+};
+
+/* Create a line reader for 'fd', reading blocks of 'blocksize' bytes, or
+ * SDS_LINE_BLOCK_SIZE if zero is passed. The reader does not close the
+ * file descriptor. Returns NULL on out of memory. */
+sdsLineReader *sdsLineReaderCreate(int fd, size_t blocksize) {
+    sdsLineReader *lr = s_malloc(sizeof(*lr));
+
+    if (lr == NULL) return NULL;
+    lr->buf = sdsempty();
+    if (lr->buf == NULL) {
+        s_free(lr);
+        return NULL;
+    }
+    lr->fd = fd;
+    lr->owned = 0;
+    lr->eof = 0;
+    lr->blocksize = blocksize ? blocksize : SDS_LINE_BLOCK_SIZE;
+    lr->used = 0;
+    lr->scanned = 0;
+    return lr;
+}
+
+/* Open the file at 'path' and create a line reader for it, using the
+ * default block size. The file is closed by sdsLineReaderRelease().
+ * Returns NULL on error, with errno set. */
+sdsLineReader *sdsLineReaderOpen(const char *path) {
+#ifdef SDS_HAVE_FDIO
+    sdsLineReader *lr;
+    int fd = open(path,O_RDONLY);
+
+    if (fd == -1) return NULL;
+    lr = sdsLineReaderCreate(fd,0);
+    if (lr == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    lr->owned = 1;
+    return lr;
+#else
+    UNUSED(path);
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+/* Store into 'line' a view of the next line, without the final newline.
+ * The last line of the file is returned even if it is not terminated by
+ * a newline. The view is valid until the next call.
+ *
+ * Returns 1 if a line was found, 0 at end of file, or -1 on read errors
+ * (with errno set), in which case the call can be retried.
+ *
+ * sdsview line;
+ * while(sdsLineReaderNext(lr,&line) == 1) processLine(line);
+ */
+int sdsLineReaderNext(sdsLineReader *lr, sdsview *line) {
+    /* The view returned by the previous call points into the buffer: only
+     * now we are allowed to consume the line. */
+    lr->buf = sdsconsume(lr->buf,lr->used);
+    lr->used = 0;
+
+    while(1) {
+        size_t len = sdslen(lr->buf);
+        char *nl = memchr(lr->buf+lr->scanned,'\n',len-lr->scanned);
+        ssize_t nread;
+        size_t readlen;
+
+        if (nl) {
+            *line = sdsviewlen(lr->buf,nl-lr->buf);
+            lr->used = nl-lr->buf+1;
+            lr->scanned = 0;
+            return 1;
+        }
+        lr->scanned = len;
+
+        if (lr->eof) {
+            if (len == 0) return 0;
+            *line = sdsviewlen(lr->buf,len);
+            lr->used = len;
+            lr->scanned = 0;
+            return 1;
+        }
+
+        readlen = lr->blocksize;
+        nread = sdsReadFromFd(&lr->buf,lr->fd,&readlen);
+        if (nread == -1) return -1;
+        if (nread == 0) lr->eof = 1;
+    }
+}
+
+/* Like sdsLineReaderNext(), but the line is copied into the string pointed
+ * by 'line', that is reused, avoiding allocations as long as its buffer is
+ * large enough. '*line' can be NULL at the first call, and must be freed
+ * by the caller at the end. */
+int sdsLineReaderNextSds(sdsLineReader *lr, sds *line) {
+    sdsview v;
+    int retval = sdsLineReaderNext(lr,&v);
+    sds s;
+
+    if (retval != 1) return retval;
+    s = *line ? sdscpylen(*line,v.ptr,v.len) : sdsnewview(v);
+    if (s == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *line = s;
+    return 1;
+}
+
+/* Free the line reader, closing the file if it was opened by
+ * sdsLineReaderOpen(). */
+void sdsLineReaderRelease(sdsLineReader *lr) {
+    if (lr == NULL) return;
+#ifdef SDS_HAVE_FDIO
+    if (lr->owned) close(lr->fd);
+#endif
+    sdsfree(lr->buf);
+    s_free(lr);
+}
+
+/* ------------------------------------ Ropes ----------------------------------
+ *
+ * A rope is a string stored as a list of fixed size chunks, every chunk
+ * being an SDS string with a capacity of at least 'chunksize' bytes. Appending never
+ * moves the data already in the rope: when the last chunk is full a new one
+ * is allocated, so the cost of an append is bounded no matter how big the
+ * rope is. This is useful to build very large replies incrementally.
+ *
+ * The rope can be written to a file descriptor with writev(), without ever
+ * copying the chunks into a single buffer, and the written bytes are
+ * consumed from the head of the rope. Flattening the rope into a single
+ * SDS string is possible, but it must be requested with sdsRopeFlatten(). */
+
+struct sdsRope {
+    sds *chunks;        /* Chunks in order. We append to the last one. */
+    size_t count;       /* Number of chunks. */
+    size_t slots;       /* Allocated entries of chunks[]. */
+    size_t head;        /* Bytes of chunks[0] already consumed. */
+    size_t len;         /* Length of the rope, minus the consumed bytes. */
+    size_t chunksize;
+    sds fmtbuf;         /* Buffer used to format by sdsRopeCatFmt(). */
+};
+
+/* Create a new empty rope using chunks of 'chunksize' bytes, or
+ * SDS_ROPE_CHUNK_SIZE if zero is passed. Returns NULL on out of memory. */
+sdsRope *sdsRopeCreate(size_t chunksize) {
+    sdsRope *r = s_malloc(sizeof(*r));
+    if (r == NULL) return NULL;
+    r->chunks = NULL;
+    r->count = 0;
+    r->slots = 0;
+    r->head = 0;
+    r->len = 0;
+    r->chunksize = chunksize ? chunksize : SDS_ROPE_CHUNK_SIZE;
+    r->fmtbuf = NULL;
+    return r;
+}
+
+/* Append a new empty chunk to the rope, and return it. Returns NULL on out
+ * of memory. */
+static sds sdsRopeNewChunk(sdsRope *r) {
+    sds chunk;
+
+    if (r->count == r->slots) {
+        size_t slots = r->slots ? r->slots*2 : 8;
+        sds *chunks = s_realloc(r->chunks,sizeof(sds)*slots);
+        if (chunks == NULL) return NULL;
+        r->chunks = chunks;
+        r->slots = slots;
+    }
+    chunk = sdsnewcap(r->chunksize);
+    if (chunk == NULL) return NULL;
+    r->chunks[r->count++] = chunk;
+    return chunk;
+}
+
+/* Append the 'len' bytes pointed by 't' to the rope. Returns 0 on success,
+ * or -1 on out of memory, in which case a part of the bytes may have been
+ * appended. */
+int sdsRopeCatLen(sdsRope *r, const void *t, size_t len) {
+    const char *p = t;
+
+    while(len) {
+        sds chunk = r->count ? r->chunks[r->count-1] : NULL;
+        size_t n;
+
+        if (chunk == NULL || sdsavail(chunk) == 0) {
+            chunk = sdsRopeNewChunk(r);
+            if (chunk == NULL) return -1;
+        }
+        n = sdsavail(chunk);
+        if (n > len) n = len;
+        memcpy(chunk+sdslen(chunk),p,n);
+        sdsIncrLen(chunk,n);
+        r->len += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Append the null terminated C string 't' to the rope. */
+int sdsRopeCat(sdsRope *r, const char *t) {
+    return sdsRopeCatLen(r,t,strlen(t));
+}
+
+/* Append the sds string 't' to the rope. */
+int sdsRopeCatSds(sdsRope *r, const sds t) {
+    return sdsRopeCatLen(r,t,sdslen(t));
+}
+
+/* Append to the rope a string formatted with sdscatfmt(), supporting the
+ * same format specifiers. */
+int sdsRopeCatFmt(sdsRope *r, char const *fmt, ...) {
+    va_list ap;
+
+    if (r->fmtbuf == NULL && (r->fmtbuf = sdsempty()) == NULL) return -1;
+    sdsclear(r->fmtbuf);
+    va_start(ap,fmt);
+    r->fmtbuf = sdscatvfmt(r->fmtbuf,fmt,ap);
+    va_end(ap);
+    if (r->fmtbuf == NULL) return -1;
+    return sdsRopeCatSds(r,r->fmtbuf);
+}
+
+/* Return the length of the rope. */
+size_t sdsRopeLen(const sdsRope *r) {
+    return r->len;
+}
+
+/* Return the number of chunks of the rope. */
+size_t sdsRopeChunks(const sdsRope *r) {
+    return r->count;
+}
+
+/* Return a view of the chunk at 'index'. Iterating from zero to
+ * sdsRopeChunks()-1 visits the whole content of the rope:
+ *
+ * for (j = 0; j < sdsRopeChunks(r); j++) {
+ *     sdsview v = sdsRopeChunk(r,j);
+ *     fwrite(v.ptr,v.len,1,fp);
+ * }
+ *
+ * The view is valid until the rope is modified. */
+sdsview sdsRopeChunk(const sdsRope *r, size_t index) {
+    sds chunk = r->chunks[index];
+    size_t skip = index == 0 ? r->head : 0;
+    return sdsviewlen(chunk+skip,sdslen(chunk)-skip);
+}
+
+/* Remove the first 'len' bytes of the rope, that must not be greater than
+ * its length. Fully consumed chunks are released, except for the last one
+ * that is reused for the next appends. */
+static void sdsRopeConsume(sdsRope *r, size_t len) {
+    size_t j = 0;
+
+    r->len -= len;
+    len += r->head;
+    while(j+1 < r->count && len >= sdslen(r->chunks[j])) {
+        len -= sdslen(r->chunks[j]);
+        sdsfree(r->chunks[j++]);
+    }
+    if (j) {
+        memmove(r->chunks,r->chunks+j,sizeof(sds)*(r->count-j));
+        r->count -= j;
+    }
+    r->head = len;
+    if (r->len == 0 && r->count) {
+        sdsclear(r->chunks[0]);
+        r->head = 0;
+    }
+}
+
+/* Write the rope to the file descriptor 'fd' with writev(), consuming the
+ * written bytes from the head of the rope. Writing continues until the
+ * rope is empty or the kernel accepts less bytes than requested, as it
+ * happens with non blocking sockets, so that the caller can call the
+ * function again once the descriptor is writable.
+ *
+ * Returns the number of bytes written. If an error occurs before anything
+ * is written -1 is returned, and errno is set, see sdsWritevArray(). */
+ssize_t sdsRopeWrite(sdsRope *r, int fd) {
+    size_t progress = r->head;
+    ssize_t nwritten = sdsWritevArray(fd,r->chunks,r->count,&progress);
+
+    if (nwritten > 0) sdsRopeConsume(r,nwritten);
+    return nwritten;
+}
+
+/* Return a new SDS string with the content of the rope, that is not
+ * modified. Returns NULL on out of memory. */
+sds sdsRopeFlatten(const sdsRope *r) {
+    sds s = sdsnewcap(r->len);
+    size_t j;
+
+    if (s == NULL) return NULL;
+    for (j = 0; j < r->count; j++) {
+        sdsview v = sdsRopeChunk(r,j);
+        memcpy(s+sdslen(s),v.ptr,v.len);
+        sdsIncrLen(s,v.len);
+    }
+    return s;
+}
+
+/* Remove all the content of the rope, releasing its chunks. */
+void sdsRopeClear(sdsRope *r) {
+    size_t j;
+
+    for (j = 0; j < r->count; j++) sdsfree(r->chunks[j]);
+    r->count = 0;
+    r->head = 0;
+    r->len = 0;
+}
+
+/* Free the rope and its content. */
+void sdsRopeRelease(sdsRope *r) {
+    if (r == NULL) return;
+    sdsRopeClear(r);
+    s_free(r->chunks);
+    sdsfree(r->fmtbuf);
+    s_free(r);
+}
+
+/* ------------------------------ Arena allocator ------------------------------
+ *
+ * The arena is an allocator context that carves the strings from big chunks
+ * of memory. Allocations just bump the used counter of the current chunk,
+ * and releases are no-ops unless the released block is the last allocated
+ * one. When a string is enlarged and it is the last block of the current
+ * chunk, it is extended in place, otherwise it is moved elsewhere in the
+ * arena. Allocations larger than the chunk size get their own chunk.
+ *
+ * All the strings are released at once with sdsArenaReset(): after the call
+ * every string created inside the arena is no longer valid. */
+
+typedef struct sdsArenaChunk {
+    struct sdsArenaChunk *next;
+    size_t size;    /* Usable bytes in data[]. */
+    size_t used;    /* Bytes already allocated. */
+    size_t last;    /* Offset of the last allocation. */
+    char data[];
+} sdsArenaChunk;
+
+struct sdsArena {
+    sdsAllocator allocator; /* Must be the first field. */
+    sdsArenaChunk *chunks;  /* The head is the chunk we allocate from. */
+    size_t chunksize;
+};
+
+/* Round 'size' to the next multiple of the pointer size, so that the
+ * arena blocks are aligned as the allocator contexts require. */
+static inline size_t sdsArenaAlign(size_t size) {
+    return (size+sizeof(void*)-1) & ~(sizeof(void*)-1);
+}
+
+static sdsArenaChunk *sdsArenaNewChunk(size_t size) {
+    sdsArenaChunk *chunk = s_malloc(sizeof(*chunk)+size);
+    if (chunk == NULL) return NULL;
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->last = 0;
+    return chunk;
+}
+
+static void *sdsArenaAlloc(sdsAllocator *a, size_t size) {
+    sdsArena *arena = (sdsArena*)a;
+    sdsArenaChunk *chunk = arena->chunks;
+
+    size = sdsArenaAlign(size);
+    if (chunk && chunk->size - chunk->used >= size) {
+        chunk->last = chunk->used;
+        chunk->used += size;
+        return chunk->data+chunk->last;
+    }
+
+    if (size > arena->chunksize) {
+        /* Big allocation: use a dedicated chunk, and link it after the
+         * current one, so that the free space of the latter is not lost. */
+        sdsArenaChunk *big = sdsArenaNewChunk(size);
+        if (big == NULL) return NULL;
+        big->used = size;
+        if (chunk) {
+            big->next = chunk->next;
+            chunk->next = big;
+        } else {
+            arena->chunks = big;
+        }
+        return big->data;
+    }
+
+    chunk = sdsArenaNewChunk(arena->chunksize);
+    if (chunk == NULL) return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    chunk->used = size;
+    return chunk->data;
+}
+
+static void *sdsArenaResize(sdsAllocator *a, void *ptr, size_t oldsize, size_t size) {
+    sdsArena *arena = (sdsArena*)a;
+    sdsArenaChunk *chunk = arena->chunks;
+    void *newptr;
+
+    /* Extend or shrink in place if this is the last block allocated. */
+    if (chunk && ptr == chunk->data+chunk->last &&
+        chunk->size - chunk->last >= sdsArenaAlign(size))
+    {
+        chunk->used = chunk->last + sdsArenaAlign(size);
+        return ptr;
+    }
+
+    /* Other blocks are shrunk in place: the space is reclaimed only by
+     * sdsArenaReset(), but there is no reason to copy them. */
+    if (size <= oldsize) return ptr;
+
+    newptr = sdsArenaAlloc(a,size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+    return newptr;
+}
+
+static void sdsArenaFree(sdsAllocator *a, void *ptr, size_t size) {
+    sdsArena *arena = (sdsArena*)a;
+    sdsArenaChunk *chunk = arena->chunks;
+
+    /* Reclaim the space only if this is the last block allocated. */
+    UNUSED(size);
+    if (chunk && ptr == chunk->data+chunk->last) chunk->used = chunk->last;
+}
+
+/* Create a new arena. Memory is allocated in chunks of 'chunksize' bytes,
+ * or SDS_ARENA_CHUNK_SIZE if zero is passed. Returns NULL on out of memory.
+ *
+ * Strings are created inside the arena using its allocator context:
+ *
+ * sdsAllocator *a = sdsArenaAllocator(arena);
+ * sds s = sdsnewlenctx("foo",3,a);
+ */
+sdsArena *sdsArenaCreate(size_t chunksize) {
+    sdsArena *arena = s_malloc(sizeof(*arena));
+    if (arena == NULL) return NULL;
+    arena->allocator.alloc = sdsArenaAlloc;
+    arena->allocator.resize = sdsArenaResize;
+    arena->allocator.release = sdsArenaFree;
+    arena->allocator.usable = NULL;
+    arena->allocator.privdata = NULL;
+    arena->chunks = NULL;
+    arena->chunksize = chunksize ? sdsArenaAlign(chunksize) : SDS_ARENA_CHUNK_SIZE;
+    return arena;
+}
+
+/* Return the allocator context to use in order to create strings inside
+ * the specified arena. */
+sdsAllocator *sdsArenaAllocator(sdsArena *arena) {
+    return &arena->allocator;
+}
+
+/* Release all the strings allocated in the arena at once. One chunk of the
+ * default size is retained, so that the arena can be reused without
+ * allocating again. */
+void sdsArenaReset(sdsArena *arena) {
+    sdsArenaChunk *chunk = arena->chunks, *next, *keep = NULL;
+
+    while(chunk) {
+        next = chunk->next;
+        if (keep == NULL && chunk->size == arena->chunksize) {
+            keep = chunk;
+            keep->next = NULL;
+            keep->used = 0;
+            keep->last = 0;
+        } else {
+            s_free(chunk);
+        }
+        chunk = next;
+    }
+    arena->chunks = keep;
+}
+
+/* Free the arena and all the strings allocated inside it. */
+void sdsArenaRelease(sdsArena *arena) {
+    if (arena == NULL) return;
+    sdsArenaReset(arena);
+    s_free(arena->chunks);
+    s_free(arena);
+}
+
+/* ------------------------------- Mmap storage --------------------------------
+ *
+ * Very large strings, like replication or log buffers, are better stored
+ * in anonymous memory mappings than in the heap: on Linux the mappings are
+ * enlarged with mremap(), that moves the pages without copying the bytes,
+ * so appending to a string of hundreds of megabytes never stalls copying
+ * it, and the memory is returned to the kernel by sdsfree().
+ *
+ * Every mapping starts with its length, so that the allocator is able to
+ * report the page rounding as usable space. The SDS block starts anywhere
+ * inside the first page of the mapping: right after the length for the
+ * mappings created by the allocator, or at the end of the page for the
+ * files mapped with sdsMapFile(), whose content starts at the second page.
+ * So the start of the mapping is always found rounding the block pointer
+ * down to the page size. */
+
+#ifdef SDS_HAVE_MMAP
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static int sdsMmapFlags = 0;
+
+static size_t sdsPageSize(void) {
+    static size_t pagesize = 0;
+
+    if (pagesize == 0) pagesize = sysconf(_SC_PAGESIZE);
+    return pagesize;
+}
+
+/* Return the length of the mapping needed for a block of 'size' bytes
+ * starting 'offset' bytes after the start of the mapping, or zero on
+ * overflow. */
+static size_t sdsMmapLen(size_t size, size_t offset) {
+    size_t pagesize = sdsPageSize();
+    size_t len = (size+offset+pagesize-1) & ~(pagesize-1);
+    return len < size ? 0 : len;
+}
+
+/* Return the start of the mapping holding the block 'ptr'. */
+static inline size_t *sdsMmapBase(void *ptr) {
+    return (size_t*)((uintptr_t)ptr & ~(uintptr_t)(sdsPageSize()-1));
+}
+
+static void *sdsMmapSetup(size_t *map, size_t len) {
+#ifdef MADV_HUGEPAGE
+    if (sdsMmapFlags & SDS_MMAP_HUGEPAGES) madvise(map,len,MADV_HUGEPAGE);
+#endif
+    *map = len;
+    return map+1;
+}
+
+static void *sdsMmapAlloc(sdsAllocator *a, size_t size) {
+    size_t len = sdsMmapLen(size,sizeof(size_t));
+    void *map;
+
+    UNUSED(a);
+    if (len == 0) return NULL;
+    map = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (map == MAP_FAILED) return NULL;
+    return sdsMmapSetup(map,len);
+}
+
+static void sdsMmapFree(sdsAllocator *a, void *ptr, size_t size) {
+    size_t *map = sdsMmapBase(ptr);
+
+    UNUSED(a);
+    UNUSED(size);
+    munmap(map,*map);
+}
+
+/* Mappings created by the allocator are enlarged by the kernel when
+ * possible. Mapped files are instead copied to a new anonymous mapping,
+ * since they are made of two different mappings. */
+static void *sdsMmapResize(sdsAllocator *a, void *ptr, size_t oldsize, size_t size) {
+    size_t *map = sdsMmapBase(ptr), len = sdsMmapLen(size,sizeof(size_t));
+    void *newmap;
+
+    if (len == 0) return NULL;
+    if ((size_t*)ptr == map+1) {
+        if (len == *map) return ptr;
+#ifdef __linux__
+        newmap = mremap(map,*map,len,MREMAP_MAYMOVE);
+        if (newmap == MAP_FAILED) return NULL;
+        return sdsMmapSetup(newmap,len);
+#endif
+    }
+    newmap = sdsMmapAlloc(a,size);
+    if (newmap == NULL) return NULL;
+    memcpy(newmap,ptr,oldsize < size ? oldsize : size);
+    sdsMmapFree(a,ptr,oldsize);
+    return newmap;
+}
+
+static size_t sdsMmapUsable(sdsAllocator *a, void *ptr) {
+    size_t *map = sdsMmapBase(ptr);
+
+    UNUSED(a);
+    return *map-((char*)ptr-(char*)map);
+}
+
+static sdsAllocator sdsMmapCtx = {
+    sdsMmapAlloc, sdsMmapResize, sdsMmapFree, sdsMmapUsable, NULL
+};
+
+/* Return a string with the content of the regular file at 'path', mapped
+ * in memory instead of being read: pages are loaded by the kernel when
+ * accessed, and are shared with the page cache until modified, so large
+ * files are loaded almost instantly and without copies.
+ *
+ * The string can be used with all the SDS functions. Modifications are
+ * private copy on write of the touched pages, and never reach the file.
+ * When the string needs to grow it is copied to an anonymous mapping (see
+ * sdsMmapAllocator()), and sdsfree() unmaps the file.
+ *
+ * Empty files return an empty string. On error NULL is returned and errno
+ * is set. Note that truncating the file while mapped makes accessing the
+ * string crash the program with SIGBUS. */
+sds sdsMapFile(const char *path) {
+    size_t pagesize = sdsPageSize(), size, len;
+    sdsAllocator *a;
+    struct stat st;
+    char *map, type;
+    int fd, hdrlen, saved_errno;
+    sds s;
+
+    if ((fd = open(path,O_RDONLY)) == -1) return NULL;
+    if (fstat(fd,&st) == -1) goto err;
+    if ((uint64_t)st.st_size > SIZE_MAX-pagesize*2) {
+        errno = EFBIG;
+        goto err;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return sdsempty();
+    }
+    size = st.st_size;
+
+    /* Reserve the address space for the header page, the file and the
+     * null term, then map the file over the reservation, after the first
+     * page. Bytes past the end of the file read as zero. */
+    len = pagesize+sdsMmapLen(size+1,0);
+    map = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (map == MAP_FAILED) goto err;
+    if (mmap(map+pagesize,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_FIXED,
+             fd,0) == MAP_FAILED)
+    {
+        saved_errno = errno;
+        munmap(map,len);
+        errno = saved_errno;
+        goto err;
+    }
+    close(fd);
+
+    *(size_t*)map = len;
+    type = sdsReqType(size);
+    if (type == SDS_TYPE_5) type = SDS_TYPE_8;
+    hdrlen = sdsHdrSize(type);
+    s = map+pagesize;
+    a = &sdsMmapCtx;
+    memcpy(s-hdrlen-sizeof(a),&a,sizeof(a));
+    s[-1] = type | SDS_FLAG_CTX;
+    sdssetlen(s,size);
+    sdsSetUsableAlloc(s, &sdsMmapCtx, s-hdrlen-sizeof(sdsAllocator*),
+                      sizeof(sdsAllocator*)+hdrlen+size+1);
+    sdsStatsAdd(s);
+    return s;
+
+err:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return NULL;
+}
+#else
+sds sdsMapFile(const char *path) {
+    UNUSED(path);
+    errno = ENOSYS;
+    return NULL;
+}
+#endif
+
+/* Store the strings having a capacity of at least 'threshold' bytes in
+ * anonymous memory mappings: the strings created with the default
+ * allocator are moved to a mapping by sdsMakeRoomFor() as soon as they
+ * need to grow past the threshold, and are created directly inside a
+ * mapping if they are large enough. A 'threshold' of zero disables the
+ * feature, that is the default. If 'flags' contains SDS_MMAP_HUGEPAGES the
+ * kernel is advised to use huge pages for the mappings.
+ *
+ * Returns 0 on success, or -1 if memory mappings are not supported on this
+ * system. As for the growth policy, the threshold is global and should be
+ * set when the program starts. */
+int sdsSetMmapThreshold(size_t threshold, int flags) {
+#ifdef SDS_HAVE_MMAP
+    sdsMmapThreshold = threshold;
+    sdsMmapFlags = flags;
+    return 0;
+#else
+    UNUSED(threshold);
+    UNUSED(flags);
+    return -1;
+#endif
+}
+
+/* Return the current mmap threshold, or zero if disabled. */
+size_t sdsGetMmapThreshold(void) {
+    return sdsMmapThreshold;
+}
+
+/* Return the allocator context storing strings in memory mappings, in order
+ * to explicitly create them with sdsnewlenctx(), or NULL if mappings are not
+ * supported on this system. */
+sdsAllocator *sdsMmapAllocator(void) {
+#ifdef SDS_HAVE_MMAP
+    return &sdsMmapCtx;
+#else
+    return NULL;
+#endif
+}
+
+/* -------------------------------- Intern pool --------------------------------
+ *
+ * The intern pool keeps a single canonical copy of every distinct content,
+ * so that programs storing many repeated values (field names, tags, ...)
+ * keep in memory just one string for each of them, and can compare the
+ * strings interned in the same pool by pointer.
+ *
+ * The canonical strings are shared strings (see sdsshare()): the pool owns
+ * a reference, and every call to sdsIntern() returns a new one. The table is
+ * an array of slots using open addressing with linear probing. The hash of
+ * every string is cached in its slot, so that probing and rehashing touch
+ * the strings only when the hashes match. The pool is not thread safe. */
+
+typedef struct sdsInternSlot {
+    sds s;          /* NULL if the slot is empty. */
+    uint64_t hash;
+} sdsInternSlot;
+
+struct sdsInternPool {
+    sdsInternSlot *slots;
+    size_t size;    /* Number of slots, always a power of two. */
+    size_t used;    /* Number of interned strings. */
+};
+
+#define SDS_INTERN_INITIAL_SIZE 16
+
+/* 64 bit FNV-1a hash of the 'len' bytes at 'p'. */
+static uint64_t sdsInternHash(const void *p, size_t len) {
+    const unsigned char *c = p;
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(len--) {
+        hash ^= *c++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Return the index of the slot holding the string with the specified
+ * content, or of the empty slot where such string should be inserted. */
+static size_t sdsInternLookup(sdsInternPool *pool, const void *p, size_t len, uint64_t hash) {
+    size_t mask = pool->size-1, idx = hash & mask;
+    sdsInternSlot *slot;
+
+    while((slot = pool->slots+idx)->s != NULL) {
+        if (slot->hash == hash && sdslen(slot->s) == len &&
+            memcmp(slot->s,p,len) == 0) break;
+        idx = (idx+1) & mask;
+    }
+    return idx;
+}
+
+/* Move the strings to a new table of 'size' slots. Returns -1 on out of
+ * memory, in which case the old table is retained. */
+static int sdsInternResize(sdsInternPool *pool, size_t size) {
+    sdsInternSlot *slots = s_malloc(sizeof(*slots)*size);
+    size_t j, idx;
+
+    if (slots == NULL) return -1;
+    memset(slots,0,sizeof(*slots)*size);
+    for (j = 0; j < pool->size; j++) {
+        if (pool->slots[j].s == NULL) continue;
+        idx = pool->slots[j].hash & (size-1);
+        while(slots[idx].s != NULL) idx = (idx+1) & (size-1);
+        slots[idx] = pool->slots[j];
+    }
+    s_free(pool->slots);
+    pool->slots = slots;
+    pool->size = size;
+    return 0;
+}
+
+/* Empty the slot 'idx'. The following strings of the same cluster are
+ * shifted back when the hole is on their probing path, so that lookups
+ * never need tombstones. */
+static void sdsInternDelete(sdsInternPool *pool, size_t idx) {
+    size_t mask = pool->size-1, j = idx, home;
+
+    pool->slots[idx].s = NULL;
+    while(1) {
+        j = (j+1) & mask;
+        if (pool->slots[j].s == NULL) break;
+        home = pool->slots[j].hash & mask;
+        if (((j-home) & mask) >= ((j-idx) & mask)) {
+            pool->slots[idx] = pool->slots[j];
+            pool->slots[j].s = NULL;
+            idx = j;
+        }
+    }
+    pool->used--;
+}
+
+/* Create a new empty intern pool. Returns NULL on out of memory. */
+sdsInternPool *sdsInternPoolCreate(void) {
+    sdsInternPool *pool = s_malloc(sizeof(*pool));
+
+    if (pool == NULL) return NULL;
+    pool->slots = NULL;
+    pool->size = 0;
+    pool->used = 0;
+    if (sdsInternResize(pool,SDS_INTERN_INITIAL_SIZE) == -1) {
+        s_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* Return the canonical string of the pool having the content of the 'len'
+ * bytes at 'p', creating it if needed. The returned string is a new
+ * reference to a shared string, that must be released with
+ * sdsInternRelease() (or sdsfree(), but in this case the pool retains the
+ * string even when no other reference exists). Returns NULL on out of
+ * memory. */
+sds sdsInternLen(sdsInternPool *pool, const void *p, size_t len) {
+    uint64_t hash = sdsInternHash(p,len);
+    size_t idx;
+    sds s;
+
+    if ((pool->used+1)*4 > pool->size*3 &&
+        sdsInternResize(pool,pool->size*2) == -1) return NULL;
+    idx = sdsInternLookup(pool,p,len,hash);
+    if (pool->slots[idx].s) return sdsdup(pool->slots[idx].s);
+
+    s = sdsCreate(p, len, len, NULL, SDS_FLAG_SHARED);
+    if (s == NULL) return NULL;
+    pool->slots[idx].s = s;
+    pool->slots[idx].hash = hash;
+    pool->used++;
+    return sdsdup(s);
+}
+
+/* Like sdsInternLen() but the content is the one of the sds string 's'.
+ * Two strings returned by the same pool have the same content if and only
+ * if they are the same pointer. */
+sds sdsIntern(sdsInternPool *pool, const sds s) {
+    return sdsInternLen(pool,s,sdslen(s));
+}
+
+/* Release a reference obtained with sdsIntern(). When the only remaining
+ * reference is the one of the pool, the string is removed from the pool
+ * and freed. Strings not interned in 'pool' are just freed with sdsfree(). */
+void sdsInternRelease(sdsInternPool *pool, sds s) {
+    size_t idx;
+
+    if (s == NULL) return;
+    if (sdsRefCount(s) == 2) {
+        idx = sdsInternLookup(pool,s,sdslen(s),sdsInternHash(s,sdslen(s)));
+        if (pool->slots[idx].s == s) {
+            sdsInternDelete(pool,idx);
+            sdsfree(s);
+        }
+    }
+    sdsfree(s);
+}
+
+/* Return the number of strings interned in the pool. */
+size_t sdsInternPoolSize(sdsInternPool *pool) {
+    return pool->used;
+}
+
+/* Free the pool, releasing its references to the interned strings: the
+ * strings still referenced elsewhere remain valid, as normal shared
+ * strings, until the last reference is freed. */
+void sdsInternPoolRelease(sdsInternPool *pool) {
+    size_t j;
+
+    if (pool == NULL) return;
+    for (j = 0; j < pool->size; j++) sdsfree(pool->slots[j].s);
+    s_free(pool->slots);
+    s_free(pool);
+}
+
+#ifdef SDS_POOL_ALLOC
+/* ------------------------------- Pool allocator ------------------------------
+ *
+ * Compiled when SDS_POOL_ALLOC is defined, in which case sdsalloc.h maps
+ * s_malloc(), s_realloc() and s_free() to the functions below.
+ *
+ * Small allocations are served from size classes tuned for the SDS headers:
+ * every type 8 string, even with an allocator context before the header,
+ * fits one of the classes up to 288 bytes, and type 16 strings are pooled up
+ * to 4k. Every class carves its blocks from 64k slabs aligned to their size
+ * and owned by a per thread cache, so the common path is just a pop or a
+ * push on a thread local free list, without locks.
+ *
+ * Blocks freed by a thread that does not own their slab are pushed into a
+ * lock free stack of the owning cache, that the owner drains when its own
+ * free list is empty. When a thread exits its cache is parked, and adopted
+ * by the next thread needing a cache.
+ *
+ * Every block is preceded by a 16 bytes header, ending with a size_t holding
+ * its usable size: slabs are aligned and all the classes are multiple of 16
+ * bytes, so the returned pointers are aligned as max_align_t on the common
+ * ABIs, like the ones of malloc(), since sds_malloc() exposes them to the
+ * programs. Allocations larger than the biggest class are served by
+ * malloc() with the same header. The memory of the slabs is never returned
+ * to the system. */
+
+#include <pthread.h>
+
+#define SDS_POOL_SLAB_SIZE (64*1024)
+#define SDS_POOL_SLAB_HDR 16  /* Slab header size, blocks start after it. */
+#define SDS_POOL_HDR 16  /* Block header size, keeps the blocks aligned. */
+#define SDS_POOL_MAX_BLOCK 4096
+#define SDS_POOL_MAX_USABLE (SDS_POOL_MAX_BLOCK-SDS_POOL_HDR)
+
+/* Block sizes of every class, block header included. */
+static const unsigned short sdsPoolClassSize[] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 288, 320, 384,
+    448, 512, 640, 768, 1024, 1280, 1536, 2048, 2560, 3072, 4096
+};
+#define SDS_POOL_CLASSES (sizeof(sdsPoolClassSize)/sizeof(sdsPoolClassSize[0]))
+
+/* Map a block size, in units of 16 bytes rounded up, to its class. */
+static unsigned char sdsPoolClassIndex[SDS_POOL_MAX_BLOCK/16+1];
+#define SDS_POOL_CLASS(size) sdsPoolClassIndex[((size)+SDS_POOL_HDR+15)/16]
+
+/* Access the usable size stored at the end of the header of 'ptr'. */
+#define SDS_POOL_USABLE(ptr) (((size_t*)(ptr))[-1])
+
+typedef struct sdsPoolCache {
+    void *free[SDS_POOL_CLASSES];   /* Free blocks of every class. */
+    char *pos[SDS_POOL_CLASSES];    /* Next block to carve from the slab. */
+    char *end[SDS_POOL_CLASSES];    /* End of the slab we are carving. */
+    void *remote;                   /* Blocks freed by other threads. */
+    struct sdsPoolCache *next;      /* Next cache in the parked list. */
+} sdsPoolCache;
+
+typedef struct sdsPoolSlab {
+    sdsPoolCache *owner;
+    size_t cls;
+} sdsPoolSlab;
+
+#define SDS_POOL_SLAB(p) \
+    ((sdsPoolSlab*)((uintptr_t)(p) & ~((uintptr_t)SDS_POOL_SLAB_SIZE-1)))
+
+static __thread sdsPoolCache *sdsPoolThreadCache = NULL;
+static sdsPoolCache *sdsPoolParked = NULL;
+static pthread_mutex_t sdsPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sdsPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t sdsPoolKey;
+
+/* Called on thread exit: park the cache so that another thread can
+ * adopt it, together with the slabs it owns. */
+static void sdsPoolThreadExit(void *cache) {
+    sdsPoolCache *c = cache;
+
+    sdsPoolThreadCache = NULL;
+    pthread_mutex_lock(&sdsPoolMutex);
+    c->next = sdsPoolParked;
+    sdsPoolParked = c;
+    pthread_mutex_unlock(&sdsPoolMutex);
+}
+
+static void sdsPoolInit(void) {
+    size_t j, cls = 0;
+
+    for (j = 0; j <= SDS_POOL_MAX_BLOCK/16; j++) {
+        while (sdsPoolClassSize[cls] < j*16) cls++;
+        sdsPoolClassIndex[j] = cls;
+    }
+    pthread_key_create(&sdsPoolKey,sdsPoolThreadExit);
+}
+
+static sdsPoolCache *sdsPoolGetCache(void) {
+    sdsPoolCache *c = sdsPoolThreadCache;
+
+    if (c) return c;
+    pthread_once(&sdsPoolOnce,sdsPoolInit);
+    pthread_mutex_lock(&sdsPoolMutex);
+    c = sdsPoolParked;
+    if (c) sdsPoolParked = c->next;
+    pthread_mutex_unlock(&sdsPoolMutex);
+    if (c == NULL) {
+        c = calloc(1,sizeof(*c));
+        if (c == NULL) return NULL;
+    }
+    c->next = NULL;
+    pthread_setspecific(sdsPoolKey,c);
+    sdsPoolThreadCache = c;
+    return c;
+}
+
+/* Move the blocks freed by other threads into the local free lists. */
+static void sdsPoolDrain(sdsPoolCache *c) {
+    void *p = __atomic_exchange_n(&c->remote,NULL,__ATOMIC_ACQUIRE);
+
+    while(p) {
+        void *next = *(void**)p;
+        size_t cls = SDS_POOL_SLAB(p)->cls;
+
+        *(void**)p = c->free[cls];
+        c->free[cls] = p;
+        p = next;
+    }
+}
+
+void *sdsPoolMalloc(size_t size) {
+    sdsPoolCache *c;
+    char *block;
+    size_t cls;
+
+    if (size > SDS_POOL_MAX_USABLE) {
+        if (size > SIZE_MAX-SDS_POOL_HDR) return NULL;
+        block = malloc(SDS_POOL_HDR+size);
+        if (block == NULL) return NULL;
+        SDS_POOL_USABLE(block+SDS_POOL_HDR) = size;
+        return block+SDS_POOL_HDR;
+    }
+
+    if ((c = sdsPoolGetCache()) == NULL) return NULL;
+    cls = SDS_POOL_CLASS(size);
+    if (c->free[cls] == NULL &&
+        __atomic_load_n(&c->remote,__ATOMIC_RELAXED) != NULL)
+    {
+        sdsPoolDrain(c);
+    }
+    if (c->free[cls]) {
+        void *p = c->free[cls];
+        c->free[cls] = *(void**)p;
+        return p;
+    }
+
+    /* Carve a new block, allocating a new slab if needed. */
+    if ((size_t)(c->end[cls]-c->pos[cls]) < sdsPoolClassSize[cls]) {
+        sdsPoolSlab *slab;
+        void *mem;
+
+        if (posix_memalign(&mem,SDS_POOL_SLAB_SIZE,SDS_POOL_SLAB_SIZE) != 0)
+            return NULL;
+        slab = mem;
+        slab->owner = c;
+        slab->cls = cls;
+        c->pos[cls] = (char*)slab+SDS_POOL_SLAB_HDR;
+        c->end[cls] = (char*)slab+SDS_POOL_SLAB_SIZE;
+    }
+    block = c->pos[cls];
+    c->pos[cls] += sdsPoolClassSize[cls];
+    SDS_POOL_USABLE(block+SDS_POOL_HDR) = sdsPoolClassSize[cls]-SDS_POOL_HDR;
+    return block+SDS_POOL_HDR;
+}
+
+void sdsPoolFree(void *ptr) {
+    char *block;
+    sdsPoolSlab *slab;
+    sdsPoolCache *c;
+
+    if (ptr == NULL) return;
+    block = (char*)ptr-SDS_POOL_HDR;
+    if (SDS_POOL_USABLE(ptr) > SDS_POOL_MAX_USABLE) {
+        free(block);
+        return;
+    }
+
+    slab = SDS_POOL_SLAB(block);
+    c = slab->owner;
+    if (c == sdsPoolThreadCache) {
+        *(void**)ptr = c->free[slab->cls];
+        c->free[slab->cls] = ptr;
+    } else {
+        void *head = __atomic_load_n(&c->remote,__ATOMIC_RELAXED);
+        do {
+            *(void**)ptr = head;
+        } while(!__atomic_compare_exchange_n(&c->remote,&head,ptr,1,
+                    __ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    }
+}
+
+size_t sdsPoolUsableSize(void *ptr) {
+    return SDS_POOL_USABLE(ptr);
+}
+
+void *sdsPoolRealloc(void *ptr, size_t size) {
+    char *block;
+    size_t usable;
+    void *newptr;
+
+    if (ptr == NULL) return sdsPoolMalloc(size);
+    block = (char*)ptr-SDS_POOL_HDR;
+    usable = SDS_POOL_USABLE(ptr);
+    if (usable > SDS_POOL_MAX_USABLE && size > SDS_POOL_MAX_USABLE) {
+        if (size > SIZE_MAX-SDS_POOL_HDR) return NULL;
+        block = realloc(block,SDS_POOL_HDR+size);
+        if (block == NULL) return NULL;
+        SDS_POOL_USABLE(block+SDS_POOL_HDR) = size;
+        return block+SDS_POOL_HDR;
+    }
+
+    /* Keep the same block if the new size still maps to its class. */
+    if (size <= usable && usable <= SDS_POOL_MAX_USABLE &&
+        SDS_POOL_CLASS(size) == SDS_POOL_SLAB(block)->cls) return ptr;
+
+    newptr = sdsPoolMalloc(size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr,ptr,usable < size ? usable : size);
+    sdsPoolFree(ptr);
+    return newptr;
+}
+#endif
+
 /* Wrappers to the allocators used by SDS. Note that SDS will actually
  * just use the macros defined into sdsalloc.h in order to avoid to pay
  * the overhead of function calls. Here we define these wrappers only for
@@ -1142,7 +4123,51 @@ void sds_free(void *ptr) { s_free(ptr); }
 #include "testhelp.h"
 #include "limits.h"
 
-#define UNUSED(x) (void)(x)
+
+/* Allocator context used by the tests in order to check that strings
+ * created with a context never use the default allocator. */
+static size_t testAllocCount, testAllocBytes;
+
+static void *testAlloc(sdsAllocator *a, size_t size) {
+    UNUSED(a);
+    testAllocCount++;
+    testAllocBytes += size;
+    return malloc(size);
+}
+
+static size_t testGrowthTriple(size_t curlen, size_t reqlen, void *privdata) {
+    UNUSED(curlen);
+    UNUSED(privdata);
+    return reqlen*3;
+}
+
+/* sdsDefrag() callback moving only the blocks at an odd position of the
+ * array of pointers passed as privdata. */
+static int testDefragOdd(void *ptr, void *privdata) {
+    void **ptrs = privdata;
+    int j;
+
+    for (j = 1; j < 10; j += 2) if (ptrs[j] == ptr) return 1;
+    return 0;
+}
+
+static void testRelease(sdsAllocator *a, void *ptr, size_t size) {
+    UNUSED(a);
+    testAllocCount--;
+    testAllocBytes -= size;
+    free(ptr);
+}
+
+#ifdef SDS_POOL_ALLOC
+static void *testPoolFreeThread(void *arg) {
+    sds *v = arg;
+    int j;
+
+    for (j = 0; j < 100; j++) sdsfree(v[j]);
+    return NULL;
+}
+#endif
+
 int sdsTest(void) {
     {
         sds x = sdsnew("foo"), y;
@@ -1223,6 +4248,37 @@ int sdsTest(void) {
         test_cond("sdstrim() correctly trims characters",
             sdslen(x) == 4 && memcmp(x,"ciao\0",5) == 0)
 
+        y = sdsnewlen("\0\xff a\0b \xff\0",9);
+        y = sdstrimlen(y,"\xff\0",2);
+        test_cond("sdstrimlen() trims a binary set",
+            sdslen(y) == 5 && memcmp(y," a\0b \0",6) == 0)
+        y = sdsltrim(y," ");
+        test_cond("sdsltrim() only trims the left",
+            sdslen(y) == 4 && memcmp(y,"a\0b \0",5) == 0)
+        y = sdsrtrim(y," ");
+        test_cond("sdsrtrim() only trims the right",
+            sdslen(y) == 3 && memcmp(y,"a\0b\0",4) == 0)
+        sdsfree(y);
+
+        {
+            sdsCharMap cm;
+            sds a, b;
+
+            a = sdsmapchars(sdsnew("hello"),"hoo","01x",3);
+            test_cond("sdsmapchars() substitutes the first match",
+                memcmp(a,"0ell1\0",6) == 0)
+            sdsfree(a);
+
+            sdsCharMapInit(&cm,":/ \xff","__\xfe-",4);
+            a = sdsCharMapApply(&cm,sdsnew("user:1000/name x"));
+            b = sdsCharMapApply(&cm,sdsnewlen("a b\xff\0",5));
+            test_cond("sdsCharMapApply() reuses the map",
+                memcmp(a,"user_1000_name\xfex\0",17) == 0 &&
+                memcmp(b,"a\xfe" "b-\0\0",6) == 0)
+            sdsfree(a);
+            sdsfree(b);
+        }
+
         y = sdsdup(x);
         sdsrange(y,1,1);
         test_cond("sdsrange(...,1,1)",
@@ -1276,6 +4332,45 @@ int sdsTest(void) {
         y = sdsnew("bar");
         test_cond("sdscmp(bar,bar)", sdscmp(x,y) < 0)
 
+        {
+            unsigned char bytes[300];
+            int j, start, ok = 1;
+
+            /* All the bytes, at every alignment and with every tail. */
+            for (j = 0; j < 300; j++) bytes[j] = j;
+            for (start = 0; start < 8; start++) {
+                sdsfree(x);
+                sdsfree(y);
+                x = sdsnewlen(bytes+start,300-start);
+                y = sdsdup(x);
+                sdstolower(x);
+                sdstoupper(y);
+                for (j = 0; j < 300-start; j++) {
+                    unsigned char c = bytes[start+j];
+                    if ((unsigned char)x[j] != ((c >= 'A' && c <= 'Z') ? c+32 : c) ||
+                        (unsigned char)y[j] != ((c >= 'a' && c <= 'z') ? c-32 : c))
+                        ok = 0;
+                }
+            }
+            test_cond("sdstolower() and sdstoupper() only convert ASCII letters",
+                ok && sdslen(x) == 293 && x[293] == '\0')
+
+            sdsfree(x);
+            sdsfree(y);
+            x = sdsnew("Content-Length: 1024 Bytes");
+            y = sdsnew("content-length: 1024 bytes");
+            test_cond("sdscasecmp() ignores the case of ASCII letters",
+                sdscasecmp(x,y) == 0 && sdscmp(x,y) < 0 &&
+                sdsviewcasecmp(sdsviewlen("GET",3),sdsviewlen("get",3)) == 0 &&
+                sdsviewcasecmp(sdsviewlen("\xc0",1),sdsviewlen("\xe0",1)) != 0)
+
+            y[24] = 'Z';
+            test_cond("sdscasecmp() orders like lower case strings",
+                sdscasecmp(x,y) < 0 && sdscasecmp(y,x) > 0 &&
+                sdsviewcasecmp(sdsviewlen("Z",1),sdsviewlen("[",1)) > 0 &&
+                sdsviewcasecmp(sdsviewlen("get",3),sdsviewlen("GET ",4)) < 0)
+        }
+
         sdsfree(y);
         sdsfree(x);
         x = sdsnewlen("\a\n\0foo\r",7);
@@ -1283,6 +4378,298 @@ int sdsTest(void) {
         test_cond("sdscatrepr(...data...)",
             memcmp(y,"\"\\a\\n\\x00foo\\r\"",15) == 0)
 
+        {
+            sds z;
+            int j;
+
+            sdsfree(y);
+            y = sdsempty();
+            for (j = 0; j < 1024; j++) {
+                char c = j < 512 ? j%256 : 'a'+j%26;
+                y = sdscatlen(y,&c,1);
+            }
+            sdsfree(x);
+            x = sdscatrepr(sdsnew("repr:"),y,sdslen(y));
+            z = sdsunrepr(x+5,sdslen(x)-5);
+            test_cond("sdsunrepr() decodes sdscatrepr() output",
+                z != NULL && sdslen(x) == 5+2+2*731+512 &&
+                memcmp(x+5+1+26*4+5*2,"\\x1f !\\\"#",9) == 0 &&
+                sdscmp(y,z) == 0)
+            sdsfree(z);
+
+            z = sdsunrepr("\"\\x4g\\q\\\\\\\"\"",12);
+            test_cond("sdsunrepr() of unusual escapes",
+                z != NULL && sdslen(z) == 6 && memcmp(z,"x4gq\\\"",6) == 0)
+            sdsfree(z);
+            test_cond("sdsunrepr() rejects invalid quoting",
+                sdsunrepr("\"foo",4) == NULL && sdsunrepr("foo\"",4) == NULL &&
+                sdsunrepr("\"a\"b\"",5) == NULL &&
+                sdsunrepr("\"\\\"",3) == NULL && sdsunrepr("\"\\",2) == NULL &&
+                sdsunrepr("\"",1) == NULL)
+            z = sdsunrepr("\"\"",2);
+            test_cond("sdsunrepr() of the empty string",
+                z != NULL && sdslen(z) == 0 && z[0] == '\0')
+            sdsfree(z);
+        }
+
+        {
+            const char *line = "  foo_-_bar_-__-_  baz ";
+            sdsview *views, v;
+            sds *tokens, s;
+            int count, vcount, j, ok = 1;
+
+            tokens = sdssplitlen(line,strlen(line),"_-_",3,&count);
+            views = sdssplitview(line,strlen(line),"_-_",3,&vcount);
+            for (j = 0; j < count && j < vcount; j++) {
+                if (views[j].len != sdslen(tokens[j]) ||
+                    memcmp(views[j].ptr,tokens[j],views[j].len)) ok = 0;
+            }
+            test_cond("sdssplitview() returns the tokens of sdssplitlen()",
+                ok && count == 4 && vcount == 4 &&
+                views[0].ptr == line && views[3].ptr == line+17)
+            sdsfreesplitres(tokens,count);
+
+            v = sdsviewtrim(views[3]," ");
+            s = sdsnewview(v);
+            s = sdscatview(s,sdsviewrange(views[1],1,-1));
+            test_cond("sdsviewtrim(), sdsviewrange() and sdsnewview()",
+                sdslen(s) == 5 && memcmp(s,"bazar\0",6) == 0 &&
+                sdsviewcmp(v,sdsviewlen("baz",3)) == 0 &&
+                sdsviewcmp(v,sdsviewlen("bazz",4)) < 0 &&
+                sdsviewcmp(sdsviewsds(s),v) > 0 &&
+                sdsviewtrim(views[2]," ").len == 0 &&
+                sdsviewrange(views[1],5,10).len == 0)
+            sdsfree(s);
+            sdsfreesplitview(views);
+            test_cond("sdssplitview() of empty strings",
+                sdssplitview("",0," ",1,&vcount) == NULL && vcount == 0)
+
+            {
+                ssize_t start, end;
+                int ok = 1;
+
+                for (start = -8; start <= 8; start++) {
+                    for (end = -8; end <= 8; end++) {
+                        s = sdsrange(sdsnew("hello"),start,end);
+                        v = sdsviewrange(sdsviewlen("hello",5),start,end);
+                        if (sdsviewcmp(sdsviewsds(s),v) != 0) ok = 0;
+                        sdsfree(s);
+                    }
+                }
+                test_cond("sdsviewrange() matches sdsrange()", ok)
+            }
+        }
+
+        {
+            sds *tokens, *packed, copy;
+            char line[1024];
+            int count, pcount, j, ok = 1;
+
+            memset(line,'x',sizeof(line));
+            memcpy(line,"a,,bc,",6);
+            line[600] = ',';
+            tokens = sdssplitlen(line,sizeof(line),",",1,&count);
+            packed = sdssplitpacked(line,sizeof(line),",",1,&pcount);
+            for (j = 0; j < count && j < pcount; j++) {
+                if (sdscmp(tokens[j],packed[j]) != 0) ok = 0;
+                if (packed[j] <= (char*)packed ||
+                    packed[j] >= (char*)packed+sizeof(line)*2) ok = 0;
+            }
+            test_cond("sdssplitpacked() returns the tokens of sdssplitlen()",
+                ok && count == 5 && pcount == 5 && sdslen(packed[4]) == 423)
+            sdsfreesplitres(tokens,count);
+
+            packed[0] = sdscat(packed[0],"foo");
+            copy = sdsdup(packed[3]);
+            ok = sdslen(packed[0]) == 4 && memcmp(packed[0],"afoo\0",5) == 0;
+            sdsfreesplitres(packed,pcount);
+            test_cond("sdssplitpacked() tokens can be modified and copied",
+                ok && sdslen(copy) == 594 && copy[0] == 'x' && copy[593] == 'x')
+            sdsfree(copy);
+        }
+
+        {
+            sds *tokens;
+            char needle[40];
+            int count;
+
+            sdsfree(x);
+            x = sdsnew("GET /a HTTP/1.1\r\nHost: b\r\n\r\n");
+            test_cond("sdsfind() and sdsrfind()",
+                sdsfind(x,"HTTP/") == 7 && sdsfind(x,"\r\n\r\n") == 24 &&
+                sdsfind(x,"") == 0 && sdsfind(x,"http") == -1 &&
+                sdsrfind(x,"\r\n") == 26 && sdsrfind(x,"G") == 0 &&
+                sdsrfind(x,"") == 28 && sdsfindlen(x,"\0",1) == -1)
+
+            tokens = sdssplitlen(x,sdslen(x),"\r\n",2,&count);
+            test_cond("sdssplitlen() with a two bytes separator",
+                count == 4 && sdslen(tokens[1]) == 7 && memcmp(tokens[1],"Host: b",7) == 0 &&
+                sdslen(tokens[2]) == 0 && sdslen(tokens[3]) == 0)
+            sdsfreesplitres(tokens,count);
+
+            /* Periodic needles, short and long, in haystacks made of
+             * almost matching runs. */
+            sdsfree(x);
+            x = sdsgrowzero(sdsempty(),4096);
+            memset(x,'a',4096);
+            x[4000] = 'b';
+            memset(needle,'a',sizeof(needle));
+            needle[sizeof(needle)-1] = 'b';
+            test_cond("sdsfind() of periodic needles",
+                sdsfindlen(x,needle+36,4) == 3997 &&
+                sdsfindlen(x,needle,sizeof(needle)) == 3961 &&
+                sdsrfindlen(x,needle+36,4) == 3997 &&
+                sdsfindlen(x,needle+1,sizeof(needle)-2) == 0 &&
+                sdsrfindlen(x,needle+1,sizeof(needle)-2) == 4096-38)
+            x[4000] = 'c';
+            test_cond("sdsfind() of missing periodic needles",
+                sdsfindlen(x,needle+36,4) == -1 &&
+                sdsfindlen(x,needle,sizeof(needle)) == -1 &&
+                sdsrfindlen(x,needle,sizeof(needle)) == -1)
+
+            /* Needles almost matching everywhere, with the only match near
+             * the start, so that the reverse search wastes work at every
+             * position before finding it. */
+            x[4000] = 'a';
+            needle[sizeof(needle)-1] = 'a';
+            needle[20] = 'b';
+            x[100] = 'b';
+            test_cond("sdsrfind() of adversarial needles",
+                sdsrfindlen(x,needle,sizeof(needle)) == 80 &&
+                sdsrfindlen(x,needle+5,20) == 100-15 &&
+                sdsrfindlen(x,needle+20,2) == 100 &&
+                sdsfindlen(x,needle,sizeof(needle)) == 80 &&
+                sdsrfindlen(x,needle,4) == 4096-4)
+        }
+
+        {
+            sds *argv;
+            int argc;
+
+            argv = sdssplitargs(" set \"key\\x41\\n\" 'it\\'s' \"\" a\"b c\"\t",&argc);
+            test_cond("sdssplitargs() handles quotes and escapes",
+                argv && argc == 5 &&
+                sdslen(argv[0]) == 3 && memcmp(argv[0],"set",3) == 0 &&
+                sdslen(argv[1]) == 5 && memcmp(argv[1],"keyA\n",5) == 0 &&
+                sdslen(argv[2]) == 4 && memcmp(argv[2],"it's",4) == 0 &&
+                sdslen(argv[3]) == 0 &&
+                sdslen(argv[4]) == 4 && memcmp(argv[4],"ab c",4) == 0)
+            sdsfreesplitres(argv,argc);
+
+            argv = sdssplitargs("   ",&argc);
+            test_cond("sdssplitargs() of empty lines and bad quotes",
+                argv && argc == 0 &&
+                sdssplitargs("\"foo\"bar",&argc) == NULL &&
+                sdssplitargs("'foo",&argc) == NULL &&
+                sdssplitargs("\"foo\\",&argc) == NULL && argc == 0)
+            sdsfreesplitres(argv,argc);
+        }
+
+        {
+            const char *input = "set \"a\\x41\\n\" 'b c'\r\nget\"\n\nping";
+            sdsArgsParser *ap = sdsArgsParserCreate();
+            sds *argv = NULL;
+            int argc = 0, j, ok = 1;
+
+            /* Feed one byte at a time, splitting every escape sequence. */
+            for (j = 0; input[j]; j++)
+                if (sdsArgsParserFeed(ap,input+j,1) != 0) ok = 0;
+            ok = ok && sdsArgsParserNext(ap,&argv,&argc) == 1 && argc == 3 &&
+                 sdslen(argv[1]) == 3 && memcmp(argv[1],"aA\n",3) == 0 &&
+                 sdslen(argv[2]) == 3 && memcmp(argv[2],"b c",3) == 0;
+            sdsfreesplitres(argv,argc);
+            test_cond("sdsArgsParser parses lines fed in chunks",
+                ok && sdsArgsParserNext(ap,&argv,&argc) == -1)
+
+            ok = sdsArgsParserNext(ap,&argv,&argc) == 1 && argc == 0;
+            sdsfreesplitres(argv,argc);
+            ok = ok && sdsArgsParserNext(ap,&argv,&argc) == 0;
+            ok = ok && sdsArgsParserFinish(ap) == 0;
+            ok = ok && sdsArgsParserNext(ap,&argv,&argc) == 1 && argc == 1 &&
+                 sdslen(argv[0]) == 4 && memcmp(argv[0],"ping",4) == 0;
+            sdsfreesplitres(argv,argc);
+            test_cond("sdsArgsParserFinish() completes the last line",
+                ok && sdsArgsParserNext(ap,&argv,&argc) == 0)
+            sdsArgsParserFree(ap);
+        }
+
+        {
+            const char *set = "ab\"' \\xn0\t";
+            char h[64], n[8];
+            int it, j, ok = 1;
+
+            /* Random inputs compared with the obvious implementations. */
+            srand(1234);
+            for (it = 0; it < 100000 && ok; it++) {
+                size_t hl = rand()%40, nl = rand()%6, i;
+                ssize_t first = -1, last = -1;
+                int k = 1+rand()%3;
+
+                for (i = 0; i < hl; i++) h[i] = 'a'+rand()%k;
+                for (i = 0; i < nl; i++) n[i] = 'a'+rand()%k;
+                for (i = 0; i+nl <= hl; i++) {
+                    if (memcmp(h+i,n,nl)) continue;
+                    if (first == -1) first = i;
+                    last = i;
+                }
+                sdsfree(x);
+                x = sdsnewlen(h,hl);
+                if (sdsfindlen(x,n,nl) != first ||
+                    sdsrfindlen(x,n,nl) != last) ok = 0;
+            }
+            test_cond("sdsfind() and sdsrfind() of random needles", ok)
+
+            for (it = 0; it < 100000 && ok; it++) {
+                size_t l = rand()%30, i;
+                sds r;
+
+                for (i = 0; i < l; i++) h[i] = rand();
+                sdsfree(x);
+                x = sdscatrepr(sdsempty(),h,l);
+                r = sdsunrepr(x,sdslen(x));
+                if (r == NULL || sdslen(r) != l || memcmp(r,h,l)) ok = 0;
+                sdsfree(r);
+            }
+            test_cond("sdsunrepr() decodes random sdscatrepr() output", ok)
+
+            for (it = 0; it < 100000 && ok; it++) {
+                sdsArgsParser *ap = sdsArgsParserCreate();
+                size_t l = rand()%20, i, p = 0;
+                sds *av1, *av2;
+                int ac1, ac2, retval;
+
+                /* Some of the lines have null bytes, that both parsers must
+                 * handle as the end of the line. */
+                for (i = 0; i < l; i++) {
+                    h[i] = set[rand()%strlen(set)];
+                    if (h[i] == '0' && rand()%4 == 0) h[i] = '\0';
+                }
+                h[l] = '\0';
+                av1 = sdssplitargs(h,&ac1);
+                while(p < l) {
+                    size_t chunk = 1+rand()%4;
+                    if (chunk > l-p) chunk = l-p;
+                    if (sdsArgsParserFeed(ap,h+p,chunk) != 0) ok = 0;
+                    p += chunk;
+                }
+                if (sdsArgsParserFeed(ap,"\n",1) != 0) ok = 0;
+                retval = sdsArgsParserNext(ap,&av2,&ac2);
+                if (av1 == NULL) {
+                    if (retval != -1) ok = 0;
+                } else if (retval != 1 || ac1 != ac2) {
+                    ok = 0;
+                } else {
+                    for (j = 0; j < ac1; j++)
+                        if (sdscmp(av1[j],av2[j]) != 0) ok = 0;
+                }
+                if (av1) sdsfreesplitres(av1,ac1);
+                if (av2) sdsfreesplitres(av2,ac2);
+                sdsArgsParserFree(ap);
+            }
+            test_cond("sdsArgsParser parses random lines like sdssplitargs()",
+                ok)
+        }
+
         {
             char *p;
             int step = 10, j, i;
@@ -1315,6 +4702,748 @@ int sdsTest(void) {
 
             sdsfree(x);
         }
+
+        {
+            sdsGrowthPolicy incr = {SDS_GROWTH_INCR, 1000, 0, NULL, NULL};
+            sdsGrowthPolicy func = {SDS_GROWTH_FUNC, 0, 0, testGrowthTriple, NULL};
+            sdsGrowthPolicy cur;
+
+            x = sdsMakeRoomForNonGreedy(sdsempty(),300);
+            test_cond("sdsMakeRoomForNonGreedy() does not preallocate",
+                sdsavail(x) >= 300 && sdsavail(x) < 400)
+
+            sdsfree(x);
+            x = sdsMakeRoomForPolicy(sdsempty(),100,&func);
+            test_cond("sdsMakeRoomForPolicy() with a growth function",
+                sdsavail(x) >= 300)
+
+            sdsfree(x);
+            sdsSetGrowthPolicy(&incr);
+            x = sdsgrowzero(sdsempty(),100);
+            sdsGetGrowthPolicy(&cur);
+            test_cond("sdsSetGrowthPolicy() changes sdsMakeRoomFor()",
+                sdsavail(x) >= 1000 && cur.type == SDS_GROWTH_INCR)
+
+            sdsfree(x);
+            sdsSetGrowthPolicy(NULL);
+            x = sdsgrowzero(sdsempty(),100);
+            sdsGetGrowthPolicy(&cur);
+            test_cond("sdsSetGrowthPolicy(NULL) restores the default",
+                sdsavail(x) < 1000 && cur.type == SDS_GROWTH_RATIO &&
+                cur.cap == SDS_MAX_PREALLOC)
+
+            sdsfree(x);
+            x = sdsnewcap(1000);
+            test_cond("sdsnewcap() reserves the requested capacity",
+                sdslen(x) == 0 && x[0] == '\0' && sdsavail(x) >= 1000 &&
+                (x[-1]&SDS_TYPE_MASK) == SDS_TYPE_16)
+            sdsfree(x);
+        }
+
+        {
+            sds v[10];
+            void *ptrs[10];
+            int j, ok = 1;
+            size_t moved;
+
+            for (j = 0; j < 10; j++) {
+                v[j] = sdscatfmt(sdsempty(),"string %i",j);
+                ptrs[j] = sdsAllocPtr(v[j]);
+            }
+            x = sdsDefrag(v[0],NULL,NULL);
+            test_cond("sdsDefrag() moves the string",
+                sdsAllocPtr(x) != ptrs[0] &&
+                memcmp(x,"string 0\0",9) == 0 && sdsavail(x) > 0)
+            v[0] = x;
+            moved = sdsDefragArray(v,10,testDefragOdd,ptrs);
+            for (j = 0; j < 10; j++) {
+                char buf[16];
+
+                if ((sdsAllocPtr(v[j]) != ptrs[j]) != (j % 2 || j == 0))
+                    ok = 0;
+                snprintf(buf,sizeof(buf),"string %d",j);
+                if (strcmp(buf,v[j]) != 0 || sdslen(v[j]) != 8) ok = 0;
+                sdsfree(v[j]);
+            }
+            test_cond("sdsDefragArray() moves only the selected strings",
+                moved == 5 && ok)
+        }
+
+        {
+            char buf[64];
+
+            x = sdsStackInit(buf,sizeof(buf));
+            x = sdscatfmt(x,"%s:%i","key",42);
+            test_cond("sdsStackInit() strings live in the caller buffer",
+                sdsAllocPtr(x) == (void*)buf && sdslen(x) == 6 &&
+                memcmp(x,"key:42\0",7) == 0 &&
+                sdsavail(x) == sizeof(buf)-sizeof(struct sdshdr8)-1-6)
+
+            test_cond("sdsRemoveFreeSpace() and sdsDefrag() keep the buffer",
+                sdsRemoveFreeSpace(x) == x && sdsDefrag(x,NULL,NULL) == x)
+            sdsfree(x); /* No-op, the string is still inside 'buf'. */
+
+            x = sdsStackInit(buf,sizeof(buf));
+            x = sdscat(x,"0123456789012345678901234567890123456789");
+            x = sdscat(x,"0123456789012345678901234567890123456789");
+            test_cond("sdsMakeRoomFor() moves stack strings to the heap",
+                sdsAllocPtr(x) != (void*)buf && sdslen(x) == 80 &&
+                memcmp(x,"01234567890123456789",20) == 0 &&
+                !(x[-1] & SDS_FLAG_STATIC) && sdsGetAllocator(x) == NULL)
+            sdsfree(x);
+        }
+
+        {
+            sds a, b, c;
+
+            x = sdsshare(sdsnew("shared value"));
+            y = sdsdup(x);
+            a = sdsdup(x);
+            test_cond("sdsdup() of shared strings increments the refcount",
+                x == y && y == a && sdsRefCount(x) == 3)
+            sdsfree(a);
+
+            y = sdscat(y," modified");
+            test_cond("sdscat() copies shared strings on write",
+                x != y && sdsRefCount(x) == 1 && sdsRefCount(y) == 1 &&
+                memcmp(x,"shared value\0",13) == 0 &&
+                memcmp(y,"shared value modified\0",22) == 0)
+            sdsfree(y);
+
+            a = sdsdup(x);
+            b = sdsdup(x);
+            c = sdsdup(x);
+            a = sdsrange(a,0,5);
+            b = sdstrim(b,"sue");
+            c = sdscpy(c,"other");
+            test_cond("sdsrange(), sdstrim(), sdscpy() copy shared strings",
+                sdsRefCount(x) == 1 && memcmp(x,"shared value\0",13) == 0 &&
+                memcmp(a,"shared\0",7) == 0 &&
+                memcmp(b,"hared val\0",10) == 0 &&
+                memcmp(c,"other\0",6) == 0)
+            sdsfree(a);
+            sdsfree(b);
+            sdsfree(c);
+
+            a = sdsdup(x);
+            a = sdsunshare(a);
+            b = sdsunshare(x);
+            test_cond("sdsunshare() copies only strings with references",
+                a != x && b == x && sdsRefCount(a) == 1)
+            sdsfree(a);
+            sdsfree(x);
+        }
+
+        {
+            sdsAllocator ctx = {testAlloc, NULL, testRelease, NULL, NULL};
+            size_t bytes = testAllocBytes, size;
+            char *first;
+            int j, ok = 1;
+
+            /* 100 commands of 9 bytes each: "cmd:1000\n", "cmd:1001\n"... */
+            x = sdsemptyctx(&ctx);
+            for (j = 0; j < 100; j++) x = sdscatfmt(x,"cmd:%i\n",1000+j);
+            first = x;
+            size = sdsAllocSize(x);
+            for (j = 1; j <= 10; j++) {
+                x = sdsconsume(x,9);
+                if (x != first+9*j || sdslen(x) != (size_t)(100-j)*9 ||
+                    sdsAllocSize(x) != size || sdsGetAllocator(x) != &ctx ||
+                    memcmp(x,"cmd:10",6) != 0 || x[6]-'0' != j/10 ||
+                    x[7]-'0' != j%10) ok = 0;
+            }
+            test_cond("sdsconsume() moves the header forward",
+                ok && (x[-1] & SDS_FLAG_OFFSET) && testAllocBytes == bytes+size)
+
+            x = sdsconsume(x,9*50);
+            test_cond("sdsconsume() compacts when most of the string is consumed",
+                !(x[-1] & SDS_FLAG_OFFSET) && sdslen(x) == 40*9 &&
+                memcmp(x,"cmd:1060\n",9) == 0 && sdsAllocSize(x) == size)
+
+            x = sdsconsume(x,9);
+            for (j = 0; j < 100; j++) x = sdscatfmt(x,"cmd:%i\n",1100+j);
+            test_cond("sdsMakeRoomFor() recovers the consumed space",
+                !(x[-1] & SDS_FLAG_OFFSET) && sdslen(x) == 139*9 &&
+                memcmp(x,"cmd:1061\n",9) == 0 &&
+                memcmp(x+sdslen(x)-9,"cmd:1199\n",10) == 0 &&
+                testAllocBytes == bytes+sdsAllocSize(x))
+
+            x = sdsconsume(x,3);
+            y = sdsconsume(sdsnewlen("abcdefghij",10),3);
+            test_cond("sdsconsume() of less bytes than the offset size",
+                memcmp(x,":1061\ncmd:1062\n",15) == 0 &&
+                memcmp(y,"defghij\0",8) == 0)
+            sdsfree(x);
+            sdsfree(y);
+
+            x = sdsshare(sdsnew("shared value"));
+            y = sdsconsume(sdsdup(x),7);
+            test_cond("sdsconsume() copies shared strings",
+                testAllocBytes == bytes && sdsRefCount(x) == 1 &&
+                memcmp(x,"shared value\0",13) == 0 &&
+                memcmp(y,"value\0",6) == 0)
+            sdsfree(x);
+            sdsfree(y);
+        }
+
+#ifdef s_malloc_usable
+        {
+            int j, ok = 1;
+
+            x = sdsempty();
+            test_cond("sdsempty() uses the allocator slack as free space",
+                sdsAllocSize(x) == s_malloc_usable(sdsAllocPtr(x)) &&
+                sdsavail(x) == sdsAllocSize(x)-sizeof(struct sdshdr8)-1)
+
+            for (j = 0; j < 1000; j++) {
+                x = sdscatlen(x,"x",1);
+                if (sdsalloc(x) > 255 && (x[-1]&SDS_TYPE_MASK) == SDS_TYPE_8)
+                    ok = 0;
+                if (sdsAllocSize(x) != s_malloc_usable(sdsAllocPtr(x)))
+                    ok = 0;
+            }
+            test_cond("Usable size is clamped to the header type max", ok)
+            sdsfree(x);
+        }
+#endif
+
+        {
+            sdsAllocator ctx = {testAlloc, NULL, testRelease, NULL, NULL};
+            int j;
+
+            x = sdsnewlenctx("ab",2,&ctx);
+            test_cond("sdsnewlenctx() uses the allocator context",
+                testAllocCount == 1 && sdsGetAllocator(x) == &ctx &&
+                sdslen(x) == 2 && memcmp(x,"ab\0",3) == 0 &&
+                testAllocBytes == sdsAllocSize(x))
+
+            /* Grow the string enough to switch a few header types. */
+            for (j = 0; j < 10000; j++) x = sdscatlen(x,"0123456789",10);
+            y = sdsdup(x);
+            test_cond("Context strings can grow and be duplicated",
+                testAllocCount == 2 && sdsGetAllocator(y) == &ctx &&
+                sdslen(x) == 100002 && sdscmp(x,y) == 0 &&
+                testAllocBytes == sdsAllocSize(x)+sdsAllocSize(y))
+
+            sdsfree(y);
+            sdsrange(x,0,9);
+            x = sdsRemoveFreeSpace(x);
+            test_cond("sdsRemoveFreeSpace() keeps the allocator context",
+                testAllocCount == 1 && sdsGetAllocator(x) == &ctx &&
+                memcmp(x,"ab01234567\0",11) == 0 &&
+                testAllocBytes == sdsAllocSize(x))
+
+            sdsfree(x);
+            x = sdsnew("foo");
+            test_cond("Context strings are released with their allocator",
+                testAllocCount == 0 && testAllocBytes == 0 &&
+                sdsGetAllocator(x) == NULL)
+            sdsfree(x);
+
+            {
+                sds *vector;
+                int count;
+
+                vector = sdssplitlenctx("1 22 333 4 5 6 7 8 9 10",23," ",1,
+                                        &count,&ctx);
+                test_cond("sdssplitlenctx() uses the allocator context",
+                    count == 10 && testAllocCount == 11 &&
+                    sdsGetAllocator(vector[9]) == &ctx &&
+                    memcmp(vector[2],"333\0",4) == 0 &&
+                    memcmp(vector[9],"10\0",3) == 0)
+                sdsfreesplitresctx(vector,count,&ctx);
+                test_cond("sdsfreesplitresctx() releases what was allocated",
+                    testAllocCount == 0 && testAllocBytes == 0)
+            }
+        }
+
+        {
+            sdsArena *arena = sdsArenaCreate(1024);
+            sdsAllocator *a = sdsArenaAllocator(arena);
+            sds tokens[3];
+            void *ptr;
+            int j, count;
+
+            x = sdsemptyctx(a);
+            ptr = sdsAllocPtr(x);
+            x = sdscatlen(x,"0123456789",10);
+            x = sdscatlen(x,"0123456789",10);
+            test_cond("Arena strings grow in place when possible",
+                sdsAllocPtr(x) == ptr && sdslen(x) == 20 &&
+                memcmp(x,"01234567890123456789\0",21) == 0)
+
+            y = sdsnewlenctx("foo",3,a);
+            for (j = 0; j < 1000; j++) x = sdscatfmt(x,"%i,",j);
+            test_cond("Arena strings can outgrow the chunk size",
+                sdslen(x) == 20+3890 && memcmp(x+20,"0,1,2,",6) == 0 &&
+                memcmp(x+sdslen(x)-4,"999,",4) == 0 &&
+                memcmp(y,"foo\0",4) == 0)
+
+            sdsfree(y);
+            y = sdsdup(x);
+            test_cond("sdsdup() of an arena string",
+                sdsGetAllocator(y) == a && sdscmp(x,y) == 0)
+
+            sdsArenaReset(arena);
+            x = sdsnewlenctx("a,b,c",5,a);
+            for (count = 0, j = 0; j < 3; j++) {
+                tokens[j] = sdsnewlenctx(x+j*2,1,a);
+                count += sdslen(tokens[j]);
+                sdsfree(tokens[j]);
+            }
+            sdsfree(x);
+            test_cond("Arena can be reused after reset", count == 3)
+
+            {
+                sds *vector;
+                size_t used;
+                int ok;
+
+                sdsArenaReset(arena);
+                x = sdsnewctx("a,bb,ccc,dddd,e,f,g",a);
+                vector = sdssplitlenctx(x,sdslen(x),",",1,&count,a);
+                ok = vector != NULL && count == 7;
+                for (j = 0; ok && j < count; j++) {
+                    ok = sdsGetAllocator(vector[j]) == a &&
+                         (char*)vector >= arena->chunks->data &&
+                         (char*)vector < arena->chunks->data+arena->chunks->used;
+                }
+                test_cond("sdssplitlenctx() allocates tokens and array in the arena",
+                    ok && sdsGetAllocator(x) == a &&
+                    memcmp(vector[0],"a\0",2) == 0 &&
+                    memcmp(vector[3],"dddd\0",5) == 0 &&
+                    memcmp(vector[6],"g\0",2) == 0)
+                used = arena->chunks->used;
+                sdsfreesplitresctx(vector,count,a);
+                test_cond("sdsfreesplitresctx() releases the arena result",
+                    arena->chunks->used < used)
+                sdsfree(x);
+            }
+            sdsArenaRelease(arena);
+        }
+
+        {
+            sdsRope *r = sdsRopeCreate(16);
+            size_t j, len = 0;
+            int ok = 1;
+
+            x = sdsempty();
+            for (j = 0; j < 100; j++) {
+                sdsRopeCat(r,"0123456789");
+                sdsRopeCatFmt(r,"%s:%i:%U,","key",(int)j,18446744073709551615ULL);
+                x = sdscat(x,"0123456789");
+                x = sdscatfmt(x,"%s:%i:%U,","key",(int)j,18446744073709551615ULL);
+            }
+            for (j = 0; j < sdsRopeChunks(r); j++) {
+                sdsview v = sdsRopeChunk(r,j);
+                if (memcmp(v.ptr,x+len,v.len) != 0) ok = 0;
+                if (v.len < 16 && j+1 < sdsRopeChunks(r)) ok = 0;
+                len += v.len;
+            }
+            y = sdsRopeFlatten(r);
+            test_cond("sdsRopeCat() and sdsRopeCatFmt() append in chunks",
+                ok && len == sdslen(x) && sdsRopeLen(r) == sdslen(x) &&
+                sdsRopeChunks(r) <= (sdslen(x)+15)/16 &&
+                sdscmp(x,y) == 0)
+            sdsfree(x);
+            sdsfree(y);
+            sdsRopeRelease(r);
+        }
+
+#ifdef SDS_HAVE_FDIO
+        {
+            char payload[100];
+            size_t hint = 16;
+            ssize_t n1, n2, n3;
+            int fds[2];
+
+            assert(pipe(fds) == 0);
+            memset(payload,'x',sizeof(payload));
+            payload[99] = 'y';
+            assert(write(fds[1],payload,sizeof(payload)) == sizeof(payload));
+            x = sdsnew("buf:");
+            n1 = sdsReadFromFd(&x,fds[0],&hint);
+            n2 = sdsReadFromFd(&x,fds[0],&hint);
+            n3 = sdsReadFromFd(&x,fds[0],&hint);
+            test_cond("sdsReadFromFd() grows the read size when reads are full",
+                n1 == 16 && n2 == 32 && n3 == 52 && hint == 64 &&
+                sdslen(x) == 104 && memcmp(x,"buf:xxx",7) == 0 &&
+                x[103] == 'y' && x[104] == '\0')
+
+            hint = 8192;
+            assert(write(fds[1],"0123456789",10) == 10);
+            n1 = sdsReadFromFd(&x,fds[0],&hint);
+            close(fds[1]);
+            n2 = sdsReadFromFd(&x,fds[0],&hint);
+            test_cond("sdsReadFromFd() shrinks the read size and returns EOF",
+                n1 == 10 && n2 == 0 && hint == 4096 && sdslen(x) == 114 &&
+                memcmp(x+104,"0123456789\0",11) == 0)
+            close(fds[0]);
+            sdsfree(x);
+        }
+
+        {
+            sds array[4];
+            char *buf = s_malloc(256*1024);
+            size_t progress = 0, total = 0;
+            ssize_t nwritten, nread;
+            int j, fds[2], ok = 1;
+
+            assert(pipe(fds) == 0);
+            array[0] = sdsnew("foo");
+            array[1] = sdsempty();
+            array[2] = sdsnew("barbaz");
+            nwritten = sdsWritevArray(fds[1],array,3,&progress);
+            nread = read(fds[0],buf,1024);
+            test_cond("sdsWritevArray() writes strings as a single stream",
+                nwritten == 9 && progress == 9 && nread == 9 &&
+                memcmp(buf,"foobarbaz",9) == 0)
+
+            progress = 4;
+            nwritten = sdsWritevArray(fds[1],array,3,&progress);
+            nread = read(fds[0],buf,1024);
+            progress = 2;
+            nwritten += sdsWriteToFd(array[2],fds[1],&progress);
+            nread += read(fds[0],buf+nread,1024);
+            test_cond("sdsWritevArray() and sdsWriteToFd() skip the progress",
+                nwritten == 9 && progress == 6 && nread == 9 &&
+                memcmp(buf,"arbazrbaz",9) == 0)
+            for (j = 0; j < 3; j++) sdsfree(array[j]);
+
+            /* Write more than the pipe can hold with a non blocking fd. */
+            for (j = 0; j < 4; j++) {
+                array[j] = sdsnewlen(NULL,64*1024);
+                memset(array[j],'a'+j,64*1024);
+            }
+            progress = 0;
+            assert(fcntl(fds[1],F_SETFL,O_NONBLOCK) == 0);
+            nwritten = sdsWritevArray(fds[1],array,4,&progress);
+            test_cond("sdsWritevArray() stops on partial writes",
+                nwritten > 0 && nwritten < 256*1024 &&
+                progress == (size_t)nwritten &&
+                sdsWritevArray(fds[1],array,4,&progress) == -1 &&
+                errno == EAGAIN)
+
+            while(total < 256*1024) {
+                nread = read(fds[0],buf+total,256*1024-total);
+                if (nread > 0) total += nread;
+                if (progress < 256*1024)
+                    sdsWritevArray(fds[1],array,4,&progress);
+            }
+            for (j = 0; j < 256*1024; j++)
+                if (buf[j] != 'a'+j/(64*1024)) ok = 0;
+            test_cond("sdsWritevArray() resumes after partial writes",
+                ok && progress == 256*1024)
+            for (j = 0; j < 4; j++) sdsfree(array[j]);
+            close(fds[0]);
+            close(fds[1]);
+            s_free(buf);
+        }
+
+        {
+            char tmpl[] = "/tmp/sds-test-XXXXXX";
+            char longline[100];
+            const char *expected[] = {"first","","second line",longline,"last"};
+            sdsLineReader *lr;
+            sdsview line;
+            sds copy = NULL, first;
+            int count = 0, ok = 1, fd = mkstemp(tmpl);
+
+            assert(fd != -1);
+            memset(longline,'x',99);
+            longline[99] = '\0';
+            assert(write(fd,"first\n\nsecond line\n",19) == 19);
+            assert(write(fd,longline,99) == 99);
+            assert(write(fd,"\nlast",5) == 5);
+            assert(lseek(fd,0,SEEK_SET) == 0);
+
+            /* Small blocks: lines straddle many of them. */
+            lr = sdsLineReaderCreate(fd,16);
+            while(sdsLineReaderNext(lr,&line) == 1) {
+                if (count > 4 ||
+                    sdsviewcmp(line,sdsviewlen(expected[count],
+                        strlen(expected[count]))) != 0) ok = 0;
+                count++;
+            }
+            test_cond("sdsLineReaderNext() returns every line",
+                ok && count == 5 && sdsLineReaderNext(lr,&line) == 0)
+            sdsLineReaderRelease(lr);
+            close(fd);
+
+            lr = sdsLineReaderOpen(tmpl);
+            count = 0;
+            ok = sdsLineReaderNextSds(lr,&copy) == 1 && !strcmp(copy,"first");
+            sdsfree(copy);
+            first = copy = sdsnewcap(128);
+            while(sdsLineReaderNextSds(lr,&copy) == 1) count++;
+            test_cond("sdsLineReaderNextSds() reuses the string",
+                ok && count == 4 && copy == first && !strcmp(copy,"last"))
+            sdsfree(copy);
+            sdsLineReaderRelease(lr);
+
+            unlink(tmpl);
+            test_cond("sdsLineReaderOpen() returns NULL on errors",
+                sdsLineReaderOpen(tmpl) == NULL && errno == ENOENT)
+        }
+
+        {
+            sdsRope *r = sdsRopeCreate(0);
+            char *buf = s_malloc(1024*1024);
+            ssize_t nwritten, nread;
+            size_t total = 0;
+            int j, fds[2], ok = 1;
+
+            assert(pipe(fds) == 0);
+            sdsRopeCat(r,"hello world");
+            nwritten = sdsRopeWrite(r,fds[1]);
+            nread = read(fds[0],buf,1024);
+            sdsRopeCat(r,"!");
+            test_cond("sdsRopeWrite() writes and consumes the rope",
+                nwritten == 11 && nread == 11 && memcmp(buf,"hello world",11) == 0 &&
+                sdsRopeLen(r) == 1 && sdsRopeChunks(r) == 1)
+
+            /* Write more than the pipe can hold with a non blocking fd. */
+            sdsRopeClear(r);
+            for (j = 0; j < 1024*1024; j += 8) sdsRopeCatFmt(r,"%u",10000000+j/8);
+            assert(fcntl(fds[1],F_SETFL,O_NONBLOCK) == 0);
+            nwritten = sdsRopeWrite(r,fds[1]);
+            test_cond("sdsRopeWrite() stops on partial writes",
+                nwritten > 0 && nwritten < 1024*1024 &&
+                sdsRopeLen(r) == (size_t)(1024*1024-nwritten) &&
+                sdsRopeWrite(r,fds[1]) == -1 && errno == EAGAIN)
+
+            while(total < 1024*1024) {
+                nread = read(fds[0],buf+total,1024*1024-total);
+                if (nread > 0) total += nread;
+                if (sdsRopeLen(r)) sdsRopeWrite(r,fds[1]);
+            }
+            for (j = 0; j < 1024*1024; j += 8) {
+                char num[16];
+                snprintf(num,sizeof(num),"%d",10000000+j/8);
+                if (memcmp(buf+j,num,8) != 0) ok = 0;
+            }
+            test_cond("sdsRopeWrite() resumes after partial writes",
+                ok && sdsRopeLen(r) == 0 && sdsRopeChunks(r) == 1)
+            close(fds[0]);
+            close(fds[1]);
+            s_free(buf);
+            sdsRopeRelease(r);
+        }
+#endif
+
+#ifdef SDS_HAVE_MMAP
+        {
+            size_t page = sysconf(_SC_PAGESIZE);
+            int j, ok = 1;
+
+            sdsSetMmapThreshold(1024*1024,0);
+            x = sdsnew("mmap");
+            y = sdsnewlen(NULL,2*1024*1024);
+            test_cond("Strings over the mmap threshold are created mapped",
+                sdsGetAllocator(x) == NULL &&
+                sdsGetAllocator(y) == sdsMmapAllocator() &&
+                (sdsAllocSize(y)+sizeof(size_t)) % page == 0 &&
+                sdsavail(y) < page)
+            sdsfree(y);
+
+            for (j = 0; j < 32*1024; j++) {
+                x = sdscatlen(x,"0123456789012345678901234567890123456789",40);
+                if (sdslen(x) >= 1024*1024 &&
+                    sdsGetAllocator(x) != sdsMmapAllocator()) ok = 0;
+            }
+            test_cond("sdsMakeRoomFor() moves strings over the threshold to mmap",
+                ok && sdsGetAllocator(x) == sdsMmapAllocator() &&
+                sdslen(x) == 4+40*32*1024 && memcmp(x,"mmap0123",8) == 0 &&
+                memcmp(x+sdslen(x)-10,"0123456789",11) == 0)
+
+            sdsrange(x,0,9);
+            x = sdsRemoveFreeSpace(x);
+            test_cond("Mapped strings can shrink",
+                sdslen(x) == 10 && memcmp(x,"mmap012345",11) == 0 &&
+                sdsAllocSize(x)+sizeof(size_t) == page)
+            sdsfree(x);
+            sdsSetMmapThreshold(0,0);
+        }
+
+        {
+            char tmpl[] = "/tmp/sds-test-XXXXXX";
+            char page[4096];
+            sds *tokens;
+            int count, fd = mkstemp(tmpl);
+
+            assert(fd != -1);
+            assert(write(fd,"foo bar\nbaz",11) == 11);
+            x = sdsMapFile(tmpl);
+            tokens = sdssplitlen(x,sdslen(x),"\n",1,&count);
+            test_cond("sdsMapFile() maps the file content",
+                x && sdslen(x) == 11 && memcmp(x,"foo bar\nbaz\0",12) == 0 &&
+                count == 2 && !sdscmp(tokens[1],y = sdsnew("baz")))
+            sdsfreesplitres(tokens,count);
+            sdsfree(y);
+
+            sdstoupper(x);
+            y = sdsMapFile(tmpl);
+            x = sdscat(x,"!");
+            test_cond("Mapped files are copied on write",
+                memcmp(x,"FOO BAR\nBAZ!\0",13) == 0 &&
+                memcmp(y,"foo bar\nbaz\0",12) == 0)
+            sdsfree(x);
+            sdsfree(y);
+
+            memset(page,'x',sizeof(page));
+            assert(ftruncate(fd,0) == 0 && lseek(fd,0,SEEK_SET) == 0);
+            x = sdsMapFile(tmpl);
+            assert(write(fd,page,sizeof(page)) == sizeof(page));
+            y = sdsMapFile(tmpl);
+            test_cond("sdsMapFile() handles empty and page sized files",
+                x && sdslen(x) == 0 && y && sdslen(y) == sizeof(page) &&
+                y[sizeof(page)] == '\0')
+            sdsfree(x);
+            sdsfree(y);
+
+            close(fd);
+            unlink(tmpl);
+            test_cond("sdsMapFile() returns NULL on errors",
+                sdsMapFile(tmpl) == NULL && errno == ENOENT)
+        }
+
+#endif
+        {
+            sdsInternPool *pool = sdsInternPoolCreate();
+            sds a, b, keys[1000];
+            char buf[32];
+            int j, ok = 1;
+
+            x = sdsnew("field");
+            a = sdsIntern(pool,x);
+            b = sdsInternLen(pool,"field",5);
+            y = sdsInternLen(pool,"other",5);
+            test_cond("sdsIntern() returns the same string for equal contents",
+                a == b && a != x && a != y && sdsRefCount(a) == 3 &&
+                sdsInternPoolSize(pool) == 2)
+            sdsInternRelease(pool,a);
+            sdsInternRelease(pool,b);
+            sdsInternRelease(pool,y);
+            sdsfree(x);
+            test_cond("sdsInternRelease() removes unreferenced strings",
+                sdsInternPoolSize(pool) == 0)
+
+            for (j = 0; j < 1000; j++) {
+                int len = snprintf(buf,sizeof(buf),"key:%d",j);
+                keys[j] = sdsInternLen(pool,buf,len);
+            }
+            for (j = 0; j < 1000; j += 2) sdsInternRelease(pool,keys[j]);
+            for (j = 0; j < 1000; j++) {
+                int len = snprintf(buf,sizeof(buf),"key:%d",j);
+                x = sdsInternLen(pool,buf,len);
+                if (j % 2 && x != keys[j]) ok = 0;
+                if (sdslen(x) != (size_t)len || memcmp(x,buf,len)) ok = 0;
+                if (j % 2) sdsInternRelease(pool,keys[j]);
+                keys[j] = x;
+            }
+            test_cond("Intern pool lookups survive resizes and deletions",
+                ok && sdsInternPoolSize(pool) == 1000)
+
+            sdsInternPoolRelease(pool);
+            test_cond("Interned strings outlive the pool",
+                sdsRefCount(keys[1]) == 1 && memcmp(keys[1],"key:1",6) == 0)
+            for (j = 0; j < 1000; j++) sdsfree(keys[j]);
+        }
+
+#ifdef SDS_STATS
+        {
+            sdsStats before, after;
+            int enabled;
+
+            enabled = sdsGetStats(&before);
+            x = sdsnew("foo");
+            y = sdscatlen(sdsempty(),"0123456789",10);
+            y = sdsgrowzero(y,1000);
+            sdsGetStats(&after);
+            test_cond("sdsGetStats() counts the live strings",
+                enabled &&
+                after.strings[SDS_TYPE_5] == before.strings[SDS_TYPE_5]+1 &&
+                after.strings[SDS_TYPE_16] == before.strings[SDS_TYPE_16]+1 &&
+                after.alloc_bytes == before.alloc_bytes+
+                                     sdsAllocSize(x)+sdsAllocSize(y) &&
+                after.header_bytes == before.header_bytes+
+                    sizeof(struct sdshdr5)+sizeof(struct sdshdr16))
+
+            test_cond("sdsGetStats() counts reallocations and upgrades",
+                after.reallocs > before.reallocs &&
+                after.upgrades == before.upgrades+1 &&
+                after.prealloc_bytes > before.prealloc_bytes)
+
+            y = sdsRemoveFreeSpace(y);
+            sdsfree(x);
+            sdsfree(y);
+            sdsGetStats(&after);
+            test_cond("sdsGetStats() after the strings are freed",
+                after.strings[SDS_TYPE_5] == before.strings[SDS_TYPE_5] &&
+                after.strings[SDS_TYPE_16] == before.strings[SDS_TYPE_16] &&
+                after.alloc_bytes == before.alloc_bytes &&
+                after.header_bytes == before.header_bytes &&
+                after.reclaimed_bytes > before.reclaimed_bytes)
+        }
+#endif
+
+#ifdef SDS_POOL_ALLOC
+        {
+            sds v[100], w[200];
+            void *ptrs[100], *ptr;
+            pthread_t tid;
+            int j, reused = 0;
+
+            x = sdsnew("foo");
+            ptr = sdsAllocPtr(x);
+            sdsfree(x);
+            x = sdsnew("bar");
+            test_cond("Pool allocator reuses freed blocks",
+                sdsAllocPtr(x) == ptr)
+
+            for (j = 0; j < 100; j++) {
+                v[j] = sdsnewlen(NULL,600);
+                ptrs[j] = sdsAllocPtr(v[j]);
+            }
+            pthread_create(&tid,NULL,testPoolFreeThread,v);
+            pthread_join(tid,NULL);
+            for (j = 0; j < 200; j++) {
+                int i;
+
+                w[j] = sdsnewlen(NULL,600);
+                for (i = 0; i < 100; i++)
+                    if (sdsAllocPtr(w[j]) == ptrs[i]) reused++;
+            }
+            for (j = 0; j < 200; j++) sdsfree(w[j]);
+            test_cond("Pool blocks freed by other threads are reused",
+                reused == 100)
+
+            for (j = 0; j < 2000; j++) x = sdscatlen(x,"0123456789",10);
+            sdsrange(x,0,4);
+            x = sdsRemoveFreeSpace(x);
+            test_cond("Pool allocator moves strings across classes",
+                sdslen(x) == 5 && memcmp(x,"bar01\0",6) == 0)
+            sdsfree(x);
+
+            {
+                size_t sizes[] = {0,1,8,17,100,272,4000,4080,5000,100000};
+                void *p[10];
+                int ok = 1;
+
+                for (j = 0; j < 10; j++) {
+                    p[j] = sds_malloc(sizes[j]);
+                    if (p[j] == NULL || (uintptr_t)p[j] % 16 != 0 ||
+                        sdsPoolUsableSize(p[j]) < sizes[j]) ok = 0;
+                }
+                for (j = 0; j < 10; j++) {
+                    p[j] = sds_realloc(p[j],sizes[9-j]);
+                    if (p[j] == NULL || (uintptr_t)p[j] % 16 != 0) ok = 0;
+                    sds_free(p[j]);
+                }
+                test_cond("Pool allocations are aligned to 16 bytes", ok)
+            }
+        }
+#endif
     }
     test_report()
     return 0;
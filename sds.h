@@ -42,6 +42,51 @@ extern const char *SDS_NOINIT;
 
 typedef char *sds;
 
+/* Growth policies, used by sdsMakeRoomFor() in order to decide how much
+ * free space to preallocate when a string must be enlarged. All the
+ * policies compute the new length starting from the required length
+ * 'reqlen', that is the current length plus the bytes to add. */
+#define SDS_GROWTH_EXACT 0  /* Just reqlen, no preallocation. */
+#define SDS_GROWTH_DOUBLE 1 /* Twice reqlen. */
+#define SDS_GROWTH_INCR 2   /* reqlen plus 'param' bytes. */
+#define SDS_GROWTH_RATIO 3  /* reqlen plus 'param' percent of it, up to 'cap'
+                               bytes of preallocation if 'cap' is not zero. */
+#define SDS_GROWTH_FUNC 4   /* Returned by fn(curlen,reqlen,privdata). */
+
+typedef struct sdsGrowthPolicy {
+    int type;
+    size_t param;
+    size_t cap;
+    size_t (*fn)(size_t curlen, size_t reqlen, void *privdata);
+    void *privdata;
+} sdsGrowthPolicy;
+
+/* An allocator context. Strings created with sdsnewlenctx() remember the
+ * context they were created with, and every later allocation, reallocation
+ * or release of the string memory is performed using it.
+ *
+ * Only the *ctx() constructors (sdsnewlenctx(), sdsnewctx(), sdsemptyctx()
+ * and sdssplitlenctx()) and the functions modifying an existing string,
+ * such as sdscat() or sdsMakeRoomFor(), use the context. sdsdup() copies
+ * the context of the source string. All the other functions returning new
+ * strings or arrays, for instance sdsfromlonglong(), sdsjoin(),
+ * sdssplitargs() or sdssplitview(), use the default allocator of sdsalloc.h.
+ *
+ * 'alloc' and 'release' are mandatory, 'release' and 'resize' also get the
+ * size of the allocation as known by SDS. If 'resize' is NULL SDS will
+ * allocate a new block, copy the old content, and release the old block.
+ * If 'usable' is not NULL it must return the real usable size of a block,
+ * that SDS uses as free space for the string. Memory returned by 'alloc'
+ * and 'resize' must be aligned at least as a pointer. 'privdata' is not
+ * used by SDS. */
+typedef struct sdsAllocator {
+    void *(*alloc)(struct sdsAllocator *a, size_t size);
+    void *(*resize)(struct sdsAllocator *a, void *ptr, size_t oldsize, size_t size);
+    void (*release)(struct sdsAllocator *a, void *ptr, size_t size);
+    size_t (*usable)(struct sdsAllocator *a, void *ptr);
+    void *privdata;
+} sdsAllocator;
+
 /* Note: sdshdr5 is never used, we just access the flags byte directly.
  * However is here to document the layout of type 5 SDS strings. */
 struct __attribute__ ((__packed__)) sdshdr5 {
@@ -84,6 +129,15 @@ struct __attribute__ ((__packed__)) sdshdr64 {
 #define SDS_HDR(T,s) ((struct sdshdr##T *)((s)-(sizeof(struct sdshdr##T))))
 #define SDS_TYPE_5_LEN(f) ((f)>>SDS_TYPE_BITS)
 
+/* The 5 most significant bits of the flags byte are unused by all the types
+ * but SDS_TYPE_5, so they are used in order to mark strings that need some
+ * special handling. Strings having any of these flags set are never created
+ * using the SDS_TYPE_5 header. */
+#define SDS_FLAG_CTX (1<<3) /* Allocator context stored before the header. */
+#define SDS_FLAG_STATIC (1<<4) /* Memory not owned by SDS, see sdsStackInit(). */
+#define SDS_FLAG_SHARED (1<<5) /* Reference count stored before the header. */
+#define SDS_FLAG_OFFSET (1<<6) /* Bytes consumed from the head, see sdsconsume(). */
+
 static inline size_t sdslen(const sds s) {
     unsigned char flags = s[-1];
     switch(flags&SDS_TYPE_MASK) {
@@ -215,10 +269,37 @@ static inline void sdssetalloc(sds s, size_t newlen) {
     }
 }
 
+/* A non owning reference to 'len' bytes at 'ptr', usually a part of a
+ * string. Views are passed by value, and are valid as long as the memory
+ * they refer to is not modified or freed. */
+typedef struct sdsview {
+    const char *ptr;
+    size_t len;
+} sdsview;
+
+static inline sdsview sdsviewlen(const void *ptr, size_t len) {
+    sdsview v;
+    v.ptr = ptr;
+    v.len = len;
+    return v;
+}
+
+/* Return a view of the whole sds string 's'. */
+static inline sdsview sdsviewsds(const sds s) {
+    return sdsviewlen(s,sdslen(s));
+}
+
 sds sdsnewlen(const void *init, size_t initlen);
+sds sdsnewlenctx(const void *init, size_t initlen, sdsAllocator *a);
 sds sdsnew(const char *init);
+sds sdsnewctx(const char *init, sdsAllocator *a);
 sds sdsempty(void);
+sds sdsemptyctx(sdsAllocator *a);
+sds sdsnewcap(size_t cap);
+sds sdsStackInit(void *buf, size_t cap);
 sds sdsdup(const sds s);
+sds sdsshare(sds s);
+sds sdsunshare(sds s);
 void sdsfree(sds s);
 sds sdsgrowzero(sds s, size_t len);
 sds sdscatlen(sds s, const void *t, size_t len);
@@ -236,17 +317,39 @@ sds sdscatprintf(sds s, const char *fmt, ...);
 #endif
 
 sds sdscatfmt(sds s, char const *fmt, ...);
+sds sdscatvfmt(sds s, char const *fmt, va_list ap);
 sds sdstrim(sds s, const char *cset);
-void sdsrange(sds s, ssize_t start, ssize_t end);
+sds sdstrimlen(sds s, const char *cset, size_t setlen);
+sds sdsltrim(sds s, const char *cset);
+sds sdsrtrim(sds s, const char *cset);
+sds sdsrange(sds s, ssize_t start, ssize_t end);
+sds sdsconsume(sds s, size_t n);
 void sdsupdatelen(sds s);
 void sdsclear(sds s);
 int sdscmp(const sds s1, const sds s2);
+int sdscasecmp(const sds s1, const sds s2);
+ssize_t sdsfind(const sds s, const char *needle);
+ssize_t sdsfindlen(const sds s, const void *needle, size_t len);
+ssize_t sdsrfind(const sds s, const char *needle);
+ssize_t sdsrfindlen(const sds s, const void *needle, size_t len);
 sds *sdssplitlen(const char *s, ssize_t len, const char *sep, int seplen, int *count);
 void sdsfreesplitres(sds *tokens, int count);
+sds *sdssplitlenctx(const char *s, ssize_t len, const char *sep, int seplen, int *count, sdsAllocator *a);
+void sdsfreesplitresctx(sds *tokens, int count, sdsAllocator *a);
+sds *sdssplitpacked(const char *s, ssize_t len, const char *sep, int seplen, int *count);
+sdsview *sdssplitview(const char *s, ssize_t len, const char *sep, int seplen, int *count);
+void sdsfreesplitview(sdsview *tokens);
+sdsview sdsviewtrim(sdsview v, const char *cset);
+sdsview sdsviewrange(sdsview v, ssize_t start, ssize_t end);
+int sdsviewcmp(sdsview v1, sdsview v2);
+int sdsviewcasecmp(sdsview v1, sdsview v2);
+sds sdsnewview(sdsview v);
+sds sdscatview(sds s, sdsview v);
 void sdstolower(sds s);
 void sdstoupper(sds s);
 sds sdsfromlonglong(long long value);
 sds sdscatrepr(sds s, const char *p, size_t len);
+sds sdsunrepr(const char *p, size_t len);
 sds *sdssplitargs(const char *line, int *argc);
 sds sdsmapchars(sds s, const char *from, const char *to, size_t setlen);
 sds sdsjoin(char **argv, int argc, char *sep);
@@ -254,10 +357,115 @@ sds sdsjoinsds(sds *argv, int argc, const char *sep, size_t seplen);
 
 /* Low level functions exposed to the user API */
 sds sdsMakeRoomFor(sds s, size_t addlen);
+sds sdsMakeRoomForNonGreedy(sds s, size_t addlen);
+sds sdsMakeRoomForPolicy(sds s, size_t addlen, const sdsGrowthPolicy *policy);
+void sdsSetGrowthPolicy(const sdsGrowthPolicy *policy);
+void sdsGetGrowthPolicy(sdsGrowthPolicy *policy);
 void sdsIncrLen(sds s, ssize_t incr);
 sds sdsRemoveFreeSpace(sds s);
+size_t sdsRefCount(const sds s);
 size_t sdsAllocSize(sds s);
 void *sdsAllocPtr(sds s);
+sdsAllocator *sdsGetAllocator(const sds s);
+sds sdsDefrag(sds s, int (*should_move)(void *ptr, void *privdata), void *privdata);
+size_t sdsDefragArray(sds *array, size_t count, int (*should_move)(void *ptr, void *privdata), void *privdata);
+
+/* Memory statistics, returned by sdsGetStats(). They are collected only if
+ * SDS is compiled with SDS_STATS defined. */
+typedef struct sdsStats {
+    size_t strings[SDS_TYPE_64+1]; /* Live strings for every header type. */
+    size_t alloc_bytes;     /* Memory used by the live strings. */
+    size_t header_bytes;    /* Part of alloc_bytes used by the headers. */
+    size_t prealloc_bytes;  /* Free space preallocated by sdsMakeRoomFor(). */
+    size_t reclaimed_bytes; /* Free space released by sdsRemoveFreeSpace(). */
+    size_t reallocs;        /* Reallocations done by sdsMakeRoomFor(). */
+    size_t upgrades;        /* Header type changes done by sdsMakeRoomFor(). */
+} sdsStats;
+int sdsGetStats(sdsStats *stats);
+
+/* File descriptors I/O: read into the free space of a string with an
+ * adaptive read size, and write strings without copying them. */
+#define SDS_READ_LEN (16*1024)
+#define SDS_READ_MIN_LEN 1024
+#define SDS_READ_MAX_LEN (1024*1024)
+ssize_t sdsReadFromFd(sds *s, int fd, size_t *hint);
+ssize_t sdsWriteToFd(const sds s, int fd, size_t *progress);
+ssize_t sdsWritevArray(int fd, const sds *array, size_t count, size_t *progress);
+
+/* Line reader: returns the lines of a file descriptor without allocating
+ * memory for every line. */
+#define SDS_LINE_BLOCK_SIZE (64*1024)
+typedef struct sdsLineReader sdsLineReader;
+sdsLineReader *sdsLineReaderCreate(int fd, size_t blocksize);
+sdsLineReader *sdsLineReaderOpen(const char *path);
+int sdsLineReaderNext(sdsLineReader *lr, sdsview *line);
+int sdsLineReaderNextSds(sdsLineReader *lr, sds *line);
+void sdsLineReaderRelease(sdsLineReader *lr);
+
+/* Character map: a translation table built once by sdsCharMapInit(), that
+ * substitutes characters like sdsmapchars() in any number of strings. */
+typedef struct sdsCharMap {
+    unsigned char map[256];
+} sdsCharMap;
+void sdsCharMapInit(sdsCharMap *cm, const char *from, const char *to, size_t setlen);
+sds sdsCharMapApply(const sdsCharMap *cm, sds s);
+
+/* Arguments parser: splits lines into arguments like sdssplitargs(), but the
+ * input is fed incrementally, in chunks of any size. */
+typedef struct sdsArgsParser sdsArgsParser;
+sdsArgsParser *sdsArgsParserCreate(void);
+int sdsArgsParserFeed(sdsArgsParser *ap, const char *buf, size_t len);
+int sdsArgsParserFinish(sdsArgsParser *ap);
+int sdsArgsParserNext(sdsArgsParser *ap, sds **argv, int *argc);
+void sdsArgsParserFree(sdsArgsParser *ap);
+
+/* Rope: a string stored as a list of fixed size chunks, so that appending
+ * never copies the existing content. Ropes are written to file descriptors
+ * with writev(), and flattened into a single string only on request. */
+#define SDS_ROPE_CHUNK_SIZE (64*1024)
+typedef struct sdsRope sdsRope;
+sdsRope *sdsRopeCreate(size_t chunksize);
+int sdsRopeCatLen(sdsRope *r, const void *t, size_t len);
+int sdsRopeCat(sdsRope *r, const char *t);
+int sdsRopeCatSds(sdsRope *r, const sds t);
+int sdsRopeCatFmt(sdsRope *r, char const *fmt, ...);
+size_t sdsRopeLen(const sdsRope *r);
+size_t sdsRopeChunks(const sdsRope *r);
+sdsview sdsRopeChunk(const sdsRope *r, size_t index);
+ssize_t sdsRopeWrite(sdsRope *r, int fd);
+sds sdsRopeFlatten(const sdsRope *r);
+void sdsRopeClear(sdsRope *r);
+void sdsRopeRelease(sdsRope *r);
+
+/* Arena allocator: strings created with the arena allocator context are
+ * bump allocated inside the arena chunks, sdsfree() is almost a no-op for
+ * them, and all of them are released at once by sdsArenaReset(). */
+#define SDS_ARENA_CHUNK_SIZE (64*1024)
+typedef struct sdsArena sdsArena;
+sdsArena *sdsArenaCreate(size_t chunksize);
+sdsAllocator *sdsArenaAllocator(sdsArena *arena);
+void sdsArenaReset(sdsArena *arena);
+void sdsArenaRelease(sdsArena *arena);
+
+/* Mmap storage: strings larger than the threshold live in anonymous memory
+ * mappings, grown without copying when the system supports it. Files can be
+ * mapped as strings with sdsMapFile(). */
+#define SDS_MMAP_HUGEPAGES (1<<0)
+int sdsSetMmapThreshold(size_t threshold, int flags);
+size_t sdsGetMmapThreshold(void);
+sdsAllocator *sdsMmapAllocator(void);
+sds sdsMapFile(const char *path);
+
+/* Intern pool: a table of canonical shared strings, one for every distinct
+ * content, so that repeated values are stored once and the strings returned
+ * by the same pool can be compared by pointer. */
+typedef struct sdsInternPool sdsInternPool;
+sdsInternPool *sdsInternPoolCreate(void);
+sds sdsInternLen(sdsInternPool *pool, const void *p, size_t len);
+sds sdsIntern(sdsInternPool *pool, const sds s);
+void sdsInternRelease(sdsInternPool *pool, sds s);
+size_t sdsInternPoolSize(sdsInternPool *pool);
+void sdsInternPoolRelease(sdsInternPool *pool);
 
 /* Export the allocator used by SDS to the program using SDS.
  * Sometimes the program SDS is linked to, may use a different set of
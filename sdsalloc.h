@@ -35,8 +35,55 @@
  * This file is used in order to change the SDS allocator at compile time.
  * Just define the following defines to what you want to use. Also add
  * the include of your alternate allocator if needed (not needed in order
- * to use the default libc allocator). */
+ * to use the default libc allocator).
+ *
+ * Optionally define s_malloc_usable, together with the allocation functions,
+ * as a function returning the real usable size of an allocation: allocators
+ * usually round up the requested size, and SDS will use the additional bytes
+ * as free space at the end of the string, instead of wasting them. As a
+ * consequence the 'alloc' field of a string may be bigger than the size
+ * requested to the allocator. It must only be defined for the allocator
+ * s_malloc actually refers to. */
 
+#if defined(SDS_POOL_ALLOC)
+/* Use the SDS builtin pool allocator, that serves the small allocations
+ * from per thread caches of size classes tuned for the SDS headers, falling
+ * back to malloc() for the bigger ones. It requires pthreads. */
+void *sdsPoolMalloc(size_t size);
+void *sdsPoolRealloc(void *ptr, size_t size);
+void sdsPoolFree(void *ptr);
+size_t sdsPoolUsableSize(void *ptr);
+#define s_malloc sdsPoolMalloc
+#define s_realloc sdsPoolRealloc
+#define s_free sdsPoolFree
+#define s_malloc_usable sdsPoolUsableSize
+#else
 #define s_malloc malloc
 #define s_realloc realloc
 #define s_free free
+
+/* The libc allocator can report the real usable size of its allocations.
+ * This is only valid for pointers returned by the libc malloc(): if the
+ * macros above are changed to use a different allocator, remove this block
+ * or define s_malloc_usable as the equivalent function of that allocator
+ * (for instance je_malloc_usable_size). Define SDS_NO_MALLOC_USABLE in
+ * order to disable it. */
+#if !defined(s_malloc_usable) && !defined(SDS_NO_MALLOC_USABLE)
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define s_malloc_usable malloc_usable_size
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define s_malloc_usable malloc_size
+#endif
+#endif
+#endif
+
+/* Allocation functions used by sdsDefrag() in order to move a string into
+ * a new block. With allocators using thread caches, like jemalloc, these
+ * should bypass the cache, otherwise the string may be moved to a block of
+ * the same fragmented page. */
+#ifndef s_malloc_defrag
+#define s_malloc_defrag s_malloc
+#define s_free_defrag s_free
+#endif
@@ -0,0 +1,493 @@
+/* SDSLib 2.0 -- benchmarks of the SDS functions.
+ *
+ * Build with "make sds-bench". Every benchmark compares the current
+ * implementation of a function with the previous one, that is kept here
+ * for reference, running both against the same realistic inputs.
+ *
+ * Copyright (c) 2006-2015, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* The benchmark is compiled as C99: enable POSIX APIs. */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include "sds.h"
+#include "sdsalloc.h"
+
+/* Run 'code' 'iterations' times, and report the time per iteration. */
+#define bench(name,iterations,code) do { \
+    long _i; \
+    clock_t _start = clock(); \
+    for (_i = 0; _i < (iterations); _i++) { code; } \
+    printf("%-40s %10.1f ns/op\n", name, \
+        (double)(clock()-_start)*1e9/CLOCKS_PER_SEC/(iterations)); \
+} while(0)
+
+/* ------------------------------ sdssplitargs() ---------------------------- */
+
+static int oldIsHexDigit(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+           (c >= 'A' && c <= 'F');
+}
+
+static int oldHexDigitToInt(char c) {
+    if (c >= '0' && c <= '9') return c-'0';
+    if (c >= 'a' && c <= 'f') return c-'a'+10;
+    if (c >= 'A' && c <= 'F') return c-'A'+10;
+    return 0;
+}
+
+/* The byte at a time sdssplitargs() implementation. */
+static sds *oldSplitArgs(const char *line, int *argc) {
+    const char *p = line;
+    char *current = NULL;
+    char **vector = NULL;
+
+    *argc = 0;
+    while(1) {
+        /* skip blanks */
+        while(*p && isspace(*p)) p++;
+        if (*p) {
+            /* get a token */
+            int inq=0;  /* set to 1 if we are in "quotes" */
+            int insq=0; /* set to 1 if we are in 'single quotes' */
+            int done=0;
+
+            if (current == NULL) current = sdsempty();
+            while(!done) {
+                if (inq) {
+                    if (*p == '\\' && *(p+1) == 'x' &&
+                                             oldIsHexDigit(*(p+2)) &&
+                                             oldIsHexDigit(*(p+3)))
+                    {
+                        unsigned char byte;
+
+                        byte = (oldHexDigitToInt(*(p+2))*16)+
+                                oldHexDigitToInt(*(p+3));
+                        current = sdscatlen(current,(char*)&byte,1);
+                        p += 3;
+                    } else if (*p == '\\' && *(p+1)) {
+                        char c;
+
+                        p++;
+                        switch(*p) {
+                        case 'n': c = '\n'; break;
+                        case 'r': c = '\r'; break;
+                        case 't': c = '\t'; break;
+                        case 'b': c = '\b'; break;
+                        case 'a': c = '\a'; break;
+                        default: c = *p; break;
+                        }
+                        current = sdscatlen(current,&c,1);
+                    } else if (*p == '"') {
+                        /* closing quote must be followed by a space or
+                         * nothing at all. */
+                        if (*(p+1) && !isspace(*(p+1))) goto err;
+                        done=1;
+                    } else if (!*p) {
+                        /* unterminated quotes */
+                        goto err;
+                    } else {
+                        current = sdscatlen(current,p,1);
+                    }
+                } else if (insq) {
+                    if (*p == '\\' && *(p+1) == '\'') {
+                        p++;
+                        current = sdscatlen(current,"'",1);
+                    } else if (*p == '\'') {
+                        /* closing quote must be followed by a space or
+                         * nothing at all. */
+                        if (*(p+1) && !isspace(*(p+1))) goto err;
+                        done=1;
+                    } else if (!*p) {
+                        /* unterminated quotes */
+                        goto err;
+                    } else {
+                        current = sdscatlen(current,p,1);
+                    }
+                } else {
+                    switch(*p) {
+                    case ' ':
+                    case '\n':
+                    case '\r':
+                    case '\t':
+                    case '\0':
+                        done=1;
+                        break;
+                    case '"':
+                        inq=1;
+                        break;
+                    case '\'':
+                        insq=1;
+                        break;
+                    default:
+                        current = sdscatlen(current,p,1);
+                        break;
+                    }
+                }
+                if (*p) p++;
+            }
+            /* add the token to the vector */
+            vector = s_realloc(vector,((*argc)+1)*sizeof(char*));
+            vector[*argc] = current;
+            (*argc)++;
+            current = NULL;
+        } else {
+            /* Even on empty input string return something not NULL. */
+            if (vector == NULL) vector = s_malloc(sizeof(void*));
+            return vector;
+        }
+    }
+
+err:
+    while((*argc)--)
+        sdsfree(vector[*argc]);
+    s_free(vector);
+    if (current) sdsfree(current);
+    *argc = 0;
+    return NULL;
+}
+
+static void benchSplitArgsLine(const char *desc, const char *line, long iterations) {
+    sds *argv;
+    int argc;
+    char name[64];
+
+    snprintf(name,sizeof(name),"sdssplitargs() %s (old)",desc);
+    bench(name,iterations,
+        argv = oldSplitArgs(line,&argc); sdsfreesplitres(argv,argc));
+    snprintf(name,sizeof(name),"sdssplitargs() %s (new)",desc);
+    bench(name,iterations,
+        argv = sdssplitargs(line,&argc); sdsfreesplitres(argv,argc));
+}
+
+static void benchSplitArgs(void) {
+    sds big = sdsempty();
+    int j;
+
+    benchSplitArgsLine("ping","PING",1000000);
+    benchSplitArgsLine("set","SET user:1000:session 8c5e2f1a9b7d4e3c",1000000);
+    benchSplitArgsLine("quoted",
+        "HSET user:1000 name \"John Smith\" email \"john@example.com\" age 42",
+        1000000);
+    benchSplitArgsLine("json",
+        "LPUSH queue '{\"id\":1234,\"type\":\"email\",\"retries\":0}'",
+        1000000);
+    benchSplitArgsLine("escapes",
+        "SET greeting \"Hello\\r\\nWorld\\x21\\x00\" EX 3600",1000000);
+
+    /* A long value, as sent by clients storing a payload inline. */
+    big = sdscat(big,"SET payload \"");
+    for (j = 0; j < 64; j++)
+        big = sdscat(big,"Lorem ipsum dolor sit amet, consectetur adipiscing. ");
+    big = sdscat(big,"\"");
+    benchSplitArgsLine("3k value",big,20000);
+    sdsfree(big);
+}
+
+/* ------------------------------- sdsconsume() ----------------------------- */
+
+/* Consume a query buffer of 'count' pipelined PING commands one by one, as
+ * done with sdsrange() before sdsconsume() was available. */
+static void benchConsume(long count) {
+    const char *ping = "*1\r\n$4\r\nPING\r\n";
+    size_t len = strlen(ping);
+    sds buf = sdsempty();
+    long j;
+
+    for (j = 0; j < count; j++) buf = sdscatlen(buf,ping,len);
+    bench("sdsrange(s,len,-1) of pipelined PINGs",count,
+        sdsrange(buf,len,-1));
+    for (j = 0; j < count; j++) buf = sdscatlen(buf,ping,len);
+    bench("sdsconsume(s,len) of pipelined PINGs",count,
+        buf = sdsconsume(buf,len));
+    sdsfree(buf);
+}
+
+/* ---------------------------- sdsLineReaderNext() ------------------------- */
+
+/* Read the lines of a 64MB log file, as done with fgets() and sdsnew()
+ * before the line reader was available. */
+static void benchLineReader(void) {
+    char tmpl[] = "/tmp/sds-bench-XXXXXX";
+    char line[1024];
+    int j, fd = mkstemp(tmpl);
+    size_t count;
+    sdsview v;
+    FILE *fp;
+
+    if (fd == -1) return;
+    fp = fdopen(fd,"w+");
+    for (j = 0; j < 1000000; j++)
+        fprintf(fp,"127.0.0.1 - - [10/Oct/2000:13:55:36] \"GET /item/%d "
+                   "HTTP/1.0\" 200 2326 \"-\" \"Mozilla/4.08\"\n",j);
+    fflush(fp);
+
+    bench("fgets()+sdsnew() of 1M lines",1,
+        rewind(fp); count = 0;
+        while(fgets(line,sizeof(line),fp)) { sdsfree(sdsnew(line)); count++; });
+    bench("sdsLineReaderNext() of 1M lines",1,
+        sdsLineReader *lr;
+        lseek(fd,0,SEEK_SET); count = 0;
+        lr = sdsLineReaderCreate(fd,0);
+        while(sdsLineReaderNext(lr,&v) == 1) count++;
+        sdsLineReaderRelease(lr));
+    fclose(fp);
+    unlink(tmpl);
+}
+
+/* ------------------------------- sdstolower() ----------------------------- */
+
+/* The tolower() based sdstolower() implementation. */
+static void oldToLower(sds s) {
+    size_t len = sdslen(s), j;
+
+    for (j = 0; j < len; j++) s[j] = tolower(s[j]);
+}
+
+static void benchToLower(void) {
+    sds cmd = sdsnew("HSET");
+    sds header = sdsnew("Content-Type: Application/JSON; Charset=UTF-8");
+    sds big = sdsnewlen(NULL,64*1024);
+    size_t j;
+
+    for (j = 0; j < sdslen(big); j++) big[j] = 'A'+j%58;
+    bench("sdstolower() command name (old)",10000000,oldToLower(cmd));
+    bench("sdstolower() command name (new)",10000000,sdstolower(cmd));
+    bench("sdstolower() header (old)",10000000,oldToLower(header));
+    bench("sdstolower() header (new)",10000000,sdstolower(header));
+    bench("sdstolower() 64k (old)",10000,oldToLower(big));
+    bench("sdstolower() 64k (new)",10000,sdstolower(big));
+    sdsfree(cmd);
+    sdsfree(header);
+    sdsfree(big);
+}
+
+/* -------------------------------- sdstrim() ------------------------------- */
+
+/* The strchr() based sdstrim() implementation. */
+static sds oldTrim(sds s, const char *cset) {
+    char *end, *sp, *ep;
+    size_t len;
+
+    sp = s;
+    ep = end = s+sdslen(s)-1;
+    while(sp <= end && strchr(cset, *sp)) sp++;
+    while(ep > sp && strchr(cset, *ep)) ep--;
+    len = (ep-sp)+1;
+    if (s != sp) memmove(s, sp, len);
+    s[len] = '\0';
+    sdssetlen(s,len);
+    return s;
+}
+
+/* Trim a copy of a value padded with 'pad' whitespace bytes per side. */
+static void benchTrimPadding(const char *desc, size_t pad, long iterations) {
+    sds orig = sdsempty(), s = sdsempty();
+    char name[64];
+    size_t j;
+
+    for (j = 0; j < pad; j++) orig = sdscat(orig,j%2 ? " " : "\t\r\n");
+    orig = sdscat(orig,"value");
+    for (j = 0; j < pad; j++) orig = sdscat(orig,j%2 ? "\n" : " \t");
+    snprintf(name,sizeof(name),"sdstrim() %s (old)",desc);
+    bench(name,iterations,s = sdscpylen(s,orig,sdslen(orig)); oldTrim(s," \t\r\n"));
+    snprintf(name,sizeof(name),"sdstrim() %s (new)",desc);
+    bench(name,iterations,s = sdscpylen(s,orig,sdslen(orig)); sdstrim(s," \t\r\n"));
+    sdsfree(orig);
+    sdsfree(s);
+}
+
+static void benchTrim(void) {
+    benchTrimPadding("short",2,10000000);
+    benchTrimPadding("64k padding",32*1024,1000);
+}
+
+/* ------------------------------ sdsmapchars() ----------------------------- */
+
+/* The sdsmapchars() implementation scanning the set for every byte. */
+static sds oldMapChars(sds s, const char *from, const char *to, size_t setlen) {
+    size_t j, i, l = sdslen(s);
+
+    for (j = 0; j < l; j++) {
+        for (i = 0; i < setlen; i++) {
+            if (s[j] == from[i]) {
+                s[j] = to[i];
+                break;
+            }
+        }
+    }
+    return s;
+}
+
+static void benchMapChars(void) {
+    const char *from = ":/ .,;|\t", *to = "________";
+    sds key = sdsnew("user:1000:session:8c5e2f1a9b7d4e3c");
+    sds big = sdsnewlen(NULL,64*1024);
+    sdsCharMap cm;
+    size_t j;
+
+    for (j = 0; j < sdslen(big); j++) big[j] = 'a'+j%26;
+    sdsCharMapInit(&cm,from,to,8);
+    bench("sdsmapchars() key (old)",10000000,oldMapChars(key,from,to,8));
+    bench("sdsmapchars() key (new)",10000000,sdsmapchars(key,from,to,8));
+    bench("sdsCharMapApply() key",10000000,sdsCharMapApply(&cm,key));
+    bench("sdsmapchars() 64k (old)",1000,oldMapChars(big,from,to,8));
+    bench("sdsmapchars() 64k (new)",1000,sdsmapchars(big,from,to,8));
+    sdsfree(key);
+    sdsfree(big);
+}
+
+/* -------------------------------- sdsfind() ------------------------------- */
+
+/* The separator search of sdssplitlen() before it used sdsfind(). */
+static sds *oldSplitLen(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
+    int elements = 0, slots = 5;
+    long start = 0, j;
+    sds *tokens;
+
+    if (seplen < 1 || len <= 0) {
+        *count = 0;
+        return NULL;
+    }
+    tokens = s_malloc(sizeof(sds)*slots);
+    for (j = 0; j < (len-(seplen-1)); j++) {
+        if (slots < elements+2) {
+            slots *= 2;
+            tokens = s_realloc(tokens,sizeof(sds)*slots);
+        }
+        if ((seplen == 1 && *(s+j) == sep[0]) || (memcmp(s+j,sep,seplen) == 0)) {
+            tokens[elements] = sdsnewlen(s+start,j-start);
+            elements++;
+            start = j+seplen;
+            j = j+seplen-1;
+        }
+    }
+    tokens[elements] = sdsnewlen(s+start,len-start);
+    elements++;
+    *count = elements;
+    return tokens;
+}
+
+static void benchFind(void) {
+    sds lines = sdsempty(), big = sdsnewlen(NULL,1024*1024);
+    const char *needle = "needle that is never found in the haystack";
+    sds *tokens;
+    int count;
+    size_t j;
+
+    while(sdslen(lines) < 1024*1024)
+        lines = sdscat(lines,"SET user:1000:session 8c5e2f1a9b7d4e3c\r\n");
+    for (j = 0; j < sdslen(big); j++) big[j] = 'a'+j%26;
+    bench("sdssplitlen() 1MB of \\r\\n lines (old)",100,
+        tokens = oldSplitLen(lines,sdslen(lines),"\r\n",2,&count);
+        sdsfreesplitres(tokens,count));
+    bench("sdssplitlen() 1MB of \\r\\n lines (new)",100,
+        tokens = sdssplitlen(lines,sdslen(lines),"\r\n",2,&count);
+        sdsfreesplitres(tokens,count));
+    bench("sdsfind() \\r\\n\\r\\n in 1MB",1000,sdsfind(lines,"\r\n\r\n"));
+    bench("sdsfind() 42 bytes needle in 1MB",1000,sdsfind(big,needle));
+    memset(big,'a',sdslen(big));
+    bench("sdsfind() a{15}ba{4} in 1MB of a",1000,sdsfind(big,"aaaaaaaaaaaaaaabaaaa"));
+    sdsfree(lines);
+    sdsfree(big);
+}
+
+/* ------------------------------- sdscatrepr() ----------------------------- */
+
+/* The byte by byte sdscatrepr() implementation. */
+static sds oldCatRepr(sds s, const char *p, size_t len) {
+    s = sdscatlen(s,"\"",1);
+    while(len--) {
+        switch(*p) {
+        case '\\':
+        case '"':
+            s = sdscatprintf(s,"\\%c",*p);
+            break;
+        case '\n': s = sdscatlen(s,"\\n",2); break;
+        case '\r': s = sdscatlen(s,"\\r",2); break;
+        case '\t': s = sdscatlen(s,"\\t",2); break;
+        case '\a': s = sdscatlen(s,"\\a",2); break;
+        case '\b': s = sdscatlen(s,"\\b",2); break;
+        default:
+            if (isprint(*p))
+                s = sdscatprintf(s,"%c",*p);
+            else
+                s = sdscatprintf(s,"\\x%02x",(unsigned char)*p);
+            break;
+        }
+        p++;
+    }
+    return sdscatlen(s,"\"",1);
+}
+
+static void benchRepr(void) {
+    sds text = sdsnewlen(NULL,64*1024), bin = sdsnewlen(NULL,64*1024);
+    sds r, *argv;
+    int argc;
+    size_t j;
+
+    for (j = 0; j < sdslen(text); j++)
+        text[j] = (j%64 == 63) ? '\n' : 'a'+j%26;
+    for (j = 0; j < sdslen(bin); j++) bin[j] = rand();
+    bench("sdscatrepr() 64k text (old)",100,sdsfree(oldCatRepr(sdsempty(),text,sdslen(text))));
+    bench("sdscatrepr() 64k text (new)",100,sdsfree(sdscatrepr(sdsempty(),text,sdslen(text))));
+    bench("sdscatrepr() 64k binary (old)",100,sdsfree(oldCatRepr(sdsempty(),bin,sdslen(bin))));
+    bench("sdscatrepr() 64k binary (new)",100,sdsfree(sdscatrepr(sdsempty(),bin,sdslen(bin))));
+
+    r = sdscatrepr(sdsempty(),text,sdslen(text));
+    bench("sdssplitargs() of 64k text repr",100,
+        argv = sdssplitargs(r,&argc); sdsfreesplitres(argv,argc));
+    bench("sdsunrepr() of 64k text repr",100,sdsfree(sdsunrepr(r,sdslen(r))));
+    sdsfree(r);
+    r = sdscatrepr(sdsempty(),bin,sdslen(bin));
+    bench("sdssplitargs() of 64k binary repr",100,
+        argv = sdssplitargs(r,&argc); sdsfreesplitres(argv,argc));
+    bench("sdsunrepr() of 64k binary repr",100,sdsfree(sdsunrepr(r,sdslen(r))));
+    sdsfree(r);
+    sdsfree(text);
+    sdsfree(bin);
+}
+
+int main(void) {
+    benchSplitArgs();
+    benchConsume(100000);
+    benchLineReader();
+    benchToLower();
+    benchTrim();
+    benchMapChars();
+    benchFind();
+    benchRepr();
+    return 0;
+}